@@ -0,0 +1,15 @@
+#!/bin/sh
+# Usage: check-tests.sh <playground>
+# Runs tests.txt through the playground and compares what it prints
+# with tests.expected. Info and errors go to stderr and are not
+# compared. After an intended change of the output, regenerate the
+# expected output with <playground> < tests.txt 2>/dev/null > tests.expected.
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 <playground>" >&2
+    exit 2
+fi
+playground=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")" || exit 2
+"$playground" < tests.txt 2>/dev/null | diff -u tests.expected - || exit 1
+echo "All tests passed."
@@ -0,0 +1,438 @@
+#pragma once
+
+#ifndef PACKED_HPP_
+#define PACKED_HPP_ 1
+
+#include"terms.hpp"
+#include"parser.hpp"
+#include<cstdint>
+#include<cstring>
+#include<vector>
+
+/* Define LAMBDA_CALCULUS_NO_SIMD to use the scalar loops only. */
+#if defined(__SSE2__) && !defined(LAMBDA_CALCULUS_NO_SIMD)
+#include<emmintrin.h>
+#define LAMBDA_CALCULUS_PACKED_SSE2 1
+#endif
+
+namespace LambdaCalculus
+{
+    /* Terms as contiguous arrays of 32-bit cells in preorder. A
+     * variable refers to its binder by de Bruijn level (the number of
+     * abstractions enclosing the binder) instead of a pointer. With
+     * levels, whether a variable is bound inside a block of cells is
+     * a comparison with a constant, so moving a block to another
+     * depth is a masked addition over the block. */
+    namespace Packed
+    {
+        typedef std::uint32_t Cell;
+        typedef Term::Pointer TermPtr;
+
+        struct Cells
+        {
+            Cells() = delete;
+            /* The kind is in the top two bits. */
+            static constexpr Cell VariableTag = 0;
+            static constexpr Cell AbstractionTag = (Cell)1 << 30;
+            static constexpr Cell ApplicationTag = (Cell)2 << 30;
+            static constexpr Cell TagMask = (Cell)3 << 30;
+            /* A variable holds its depth (the number of abstractions
+             * enclosing it) above DepthShift, and the level of its
+             * binder below. An abstraction holds its own level, and
+             * an application holds nothing. */
+            static constexpr unsigned DepthShift = 15;
+            static constexpr Cell LevelMask = ((Cell)1 << DepthShift) - 1;
+            static constexpr Cell MaxDepth = LevelMask;
+
+            static Cell Variable(Cell depth, Cell level)
+            {
+                return VariableTag | depth << DepthShift | level;
+            }
+            static Cell Abstraction(Cell level)
+            {
+                return AbstractionTag | level;
+            }
+            static Cell Application()
+            {
+                return ApplicationTag;
+            }
+            static Cell Tag(Cell cell)
+            {
+                return cell & TagMask;
+            }
+            static Cell Level(Cell cell)
+            {
+                return cell & LevelMask;
+            }
+            static Cell Depth(Cell cell)
+            {
+                return (cell >> DepthShift) & LevelMask;
+            }
+            /* Returns the end of the subterm starting at begin, and
+             * raises maxDepth to the largest depth of its variables. */
+            static size_t End(Cell const *cells, size_t begin, Cell &maxDepth)
+            {
+                size_t pending = 1;
+                while (pending != 0)
+                {
+                    auto const cell = cells[begin++];
+                    switch (Tag(cell))
+                    {
+                        case ApplicationTag:
+                            ++pending;
+                            break;
+                        case VariableTag:
+                            --pending;
+                            if (Depth(cell) > maxDepth)
+                            {
+                                maxDepth = Depth(cell);
+                            }
+                            break;
+                    }
+                }
+                return begin;
+            }
+        };
+
+        /* The loops over cells, vectorised with SSE2 if available. */
+        struct Kernels
+        {
+            Kernels() = delete;
+            static constexpr size_t None = (size_t)-1;
+
+            /* Returns the first application whose function is an
+             * abstraction, which is the leftmost outermost redex. */
+            static size_t FindRedex(Cell const *cells, size_t count)
+            {
+                size_t i = 0;
+#ifdef LAMBDA_CALCULUS_PACKED_SSE2
+                __m128i const application = _mm_set1_epi32(2);
+                __m128i const abstraction = _mm_set1_epi32(1);
+                for (; i + 5 <= count; i += 4)
+                {
+                    __m128i const tags = _mm_srli_epi32(
+                        _mm_loadu_si128((__m128i const *)(cells + i)), 30);
+                    __m128i const next = _mm_srli_epi32(
+                        _mm_loadu_si128((__m128i const *)(cells + i + 1)), 30);
+                    __m128i const found = _mm_and_si128(
+                        _mm_cmpeq_epi32(tags, application),
+                        _mm_cmpeq_epi32(next, abstraction));
+                    if (_mm_movemask_epi8(found) != 0)
+                    {
+                        break;
+                    }
+                }
+#endif
+                for (; i + 1 < count; ++i)
+                {
+                    if (Cells::Tag(cells[i]) == Cells::ApplicationTag
+                        && Cells::Tag(cells[i + 1]) == Cells::AbstractionTag)
+                    {
+                        return i;
+                    }
+                }
+                return None;
+            }
+
+            /* Counts the variables of the given level, and raises
+             * maxDepth to the largest depth among them. */
+            static size_t CountOccurrences(Cell const *cells, size_t count, Cell level, Cell &maxDepth)
+            {
+                size_t result = 0;
+                size_t i = 0;
+#ifdef LAMBDA_CALCULUS_PACKED_SSE2
+                __m128i const mask = _mm_set1_epi32((int)(Cells::TagMask | Cells::LevelMask));
+                __m128i const wanted = _mm_set1_epi32((int)level);
+                for (; i + 4 <= count; i += 4)
+                {
+                    __m128i const found = _mm_cmpeq_epi32(_mm_and_si128(
+                        _mm_loadu_si128((__m128i const *)(cells + i)), mask), wanted);
+                    if (_mm_movemask_epi8(found) != 0)
+                    {
+                        result += CountOccurrencesScalar(cells + i, 4, level, maxDepth);
+                    }
+                }
+#endif
+                return result + CountOccurrencesScalar(cells + i, count - i, level, maxDepth);
+            }
+
+            /* Copies a block that loses one enclosing abstraction at
+             * the given level: variables get one level shallower, and
+             * so do the binders deeper than level. The block must not
+             * contain variables of the removed level. */
+            static void Lower(Cell *out, Cell const *in, size_t count, Cell level)
+            {
+                size_t i = 0;
+#ifdef LAMBDA_CALCULUS_PACKED_SSE2
+                __m128i const levelMask = _mm_set1_epi32((int)Cells::LevelMask);
+                __m128i const threshold = _mm_set1_epi32((int)level);
+                __m128i const depthOne = _mm_set1_epi32(1 << Cells::DepthShift);
+                __m128i const zero = _mm_setzero_si128();
+                for (; i + 4 <= count; i += 4)
+                {
+                    __m128i cells = _mm_loadu_si128((__m128i const *)(in + i));
+                    /* Applications have level 0, never greater. */
+                    __m128i const deeper = _mm_cmpgt_epi32(_mm_and_si128(cells, levelMask), threshold);
+                    __m128i const variable = _mm_cmpeq_epi32(_mm_srli_epi32(cells, 30), zero);
+                    cells = _mm_add_epi32(cells, deeper);
+                    cells = _mm_sub_epi32(cells, _mm_and_si128(variable, depthOne));
+                    _mm_storeu_si128((__m128i *)(out + i), cells);
+                }
+#endif
+                for (; i != count; ++i)
+                {
+                    Cell cell = in[i];
+                    cell -= (Cell)(Cells::Level(cell) > level);
+                    cell -= (Cell)(Cells::Tag(cell) == Cells::VariableTag) << Cells::DepthShift;
+                    out[i] = cell;
+                }
+            }
+
+            /* Copies a block taken from the given level delta levels
+             * deeper: variables get deeper, and so do the binders at
+             * or below level, i.e. those inside the block. */
+            static void Raise(Cell *out, Cell const *in, size_t count, Cell level, Cell delta)
+            {
+                if (delta == 0)
+                {
+                    std::memcpy(out, in, count * sizeof(Cell));
+                    return;
+                }
+                size_t i = 0;
+#ifdef LAMBDA_CALCULUS_PACKED_SSE2
+                __m128i const levelMask = _mm_set1_epi32((int)Cells::LevelMask);
+                __m128i const threshold = _mm_set1_epi32((int)level - 1);
+                __m128i const levelDelta = _mm_set1_epi32((int)delta);
+                __m128i const depthDelta = _mm_set1_epi32((int)(delta << Cells::DepthShift));
+                __m128i const minusOne = _mm_set1_epi32(-1);
+                __m128i const zero = _mm_setzero_si128();
+                for (; i + 4 <= count; i += 4)
+                {
+                    __m128i cells = _mm_loadu_si128((__m128i const *)(in + i));
+                    /* Only applications have the sign bit set. */
+                    __m128i const inside = _mm_and_si128(
+                        _mm_cmpgt_epi32(_mm_and_si128(cells, levelMask), threshold),
+                        _mm_cmpgt_epi32(cells, minusOne));
+                    __m128i const variable = _mm_cmpeq_epi32(_mm_srli_epi32(cells, 30), zero);
+                    cells = _mm_add_epi32(cells, _mm_and_si128(inside, levelDelta));
+                    cells = _mm_add_epi32(cells, _mm_and_si128(variable, depthDelta));
+                    _mm_storeu_si128((__m128i *)(out + i), cells);
+                }
+#endif
+                for (; i != count; ++i)
+                {
+                    Cell cell = in[i];
+                    auto const tag = Cells::Tag(cell);
+                    if (tag != Cells::ApplicationTag && Cells::Level(cell) >= level)
+                    {
+                        cell += delta;
+                    }
+                    if (tag == Cells::VariableTag)
+                    {
+                        cell += delta << Cells::DepthShift;
+                    }
+                    out[i] = cell;
+                }
+            }
+
+        private:
+            static size_t CountOccurrencesScalar(Cell const *cells, size_t count, Cell level, Cell &maxDepth)
+            {
+                size_t result = 0;
+                for (size_t i = 0; i != count; ++i)
+                {
+                    if ((cells[i] & (Cells::TagMask | Cells::LevelMask)) == level)
+                    {
+                        ++result;
+                        if (Cells::Depth(cells[i]) > maxDepth)
+                        {
+                            maxDepth = Cells::Depth(cells[i]);
+                        }
+                    }
+                }
+                return result;
+            }
+        };
+
+        /* Converts a closed term. Native terms are converted in their
+         * Church form, and shared subterms are copied. Fails if the
+         * term is open, too deep or has references. */
+        struct Encoder : Term::Visitor<Encoder, bool (TermPtr const &, Cell)>
+        {
+            friend struct Term::Visitor<Encoder, bool (TermPtr const &, Cell)>;
+            static bool Perform(TermPtr const &target, std::vector<Cell> &cells)
+            {
+                cells.clear();
+                Encoder instance(cells);
+                return instance.VisitTerm(target, 0);
+            }
+        private:
+            typedef Utilities::PodSurrogate<Cell> LevelTag;
+            explicit Encoder(std::vector<Cell> &cells) : cells(cells) { }
+            std::vector<Cell> &cells;
+            bool VisitInvalidTerm(TermPtr const &, Cell)
+            {
+                return false;
+            }
+            bool VisitInternalErrorTerm(TermPtr const &, Cell)
+            {
+                return false;
+            }
+            bool VisitBoundVariableTerm(TermPtr const &target, Cell depth)
+            {
+                auto const &tag = target->AsBoundVariable.BoundBy->Tag;
+                if (!tag.Is<LevelTag>() || depth > Cells::MaxDepth)
+                {
+                    return false;
+                }
+                cells.push_back(Cells::Variable(depth, tag.RawPtrUnsafe<LevelTag>()->Value));
+                return true;
+            }
+            bool VisitNativeTerm(TermPtr const &target, Cell depth)
+            {
+                auto const materialised = target->AsNative.Operation == Term::NativeNumeral
+                    ? DeBruijnIndex::Parser::ChurchEncoding::Numeral(target->AsNative.Value)
+                    : DeBruijnIndex::Parser::ChurchEncoding::Operation(target->AsNative.Operation);
+                return VisitTerm(materialised, depth);
+            }
+            bool VisitReferenceTerm(TermPtr const &, Cell)
+            {
+                /* Cycles cannot be packed. */
+                return false;
+            }
+            bool VisitAbstractionTerm(TermPtr const &target, Cell depth)
+            {
+                target->Tag.NewInstance<LevelTag>()->Value = depth;
+                cells.push_back(Cells::Abstraction(depth));
+                bool const result = VisitTerm(target->AsAbstraction.Result, depth + 1);
+                target->Tag = nullptr;
+                return result;
+            }
+            bool VisitApplicationTerm(TermPtr const &target, Cell depth)
+            {
+                cells.push_back(Cells::Application());
+                return VisitTerm(target->AsApplication.Function, depth)
+                    && VisitTerm(target->AsApplication.Replaced, depth);
+            }
+        };
+
+        struct Decoder
+        {
+            Decoder() = delete;
+            static TermPtr Perform(std::vector<Cell> const &cells)
+            {
+                std::vector<TermPtr> binders, variables;
+                size_t position = 0;
+                return Decode(cells.data(), position, binders, variables);
+            }
+        private:
+            static TermPtr Decode(Cell const *cells, size_t &position,
+                std::vector<TermPtr> &binders, std::vector<TermPtr> &variables)
+            {
+                auto const cell = cells[position++];
+                TermPtr result;
+                switch (Cells::Tag(cell))
+                {
+                    case Cells::VariableTag:
+                    {
+                        auto &variable = variables[Cells::Level(cell)];
+                        if (!(bool)variable)
+                        {
+                            variable.NewInstance()->BoundVariableConstructor(binders[Cells::Level(cell)]);
+                        }
+                        return variable;
+                    }
+                    case Cells::AbstractionTag:
+                    {
+                        result.NewInstance();
+                        binders.push_back(result);
+                        variables.push_back(nullptr);
+                        auto body = Decode(cells, position, binders, variables);
+                        auto variable = std::move(variables.back());
+                        variables.pop_back();
+                        binders.pop_back();
+                        result->AbstractionConstructor(std::move(variable), std::move(body));
+                        return result;
+                    }
+                    default:
+                    {
+                        auto func = Decode(cells, position, binders, variables);
+                        auto rplc = Decode(cells, position, binders, variables);
+                        result.NewInstance()->ApplicationConstructor(std::move(func), std::move(rplc));
+                        return result;
+                    }
+                }
+            }
+        };
+
+        typedef unsigned OutcomeKind;
+
+        struct Outcome
+        {
+            static constexpr OutcomeKind Reduced = 0;
+            static constexpr OutcomeKind NormalForm = 1;
+            /* The result would be deeper than Cells::MaxDepth. */
+            static constexpr OutcomeKind TooDeep = 2;
+        };
+
+        /* Contracts the leftmost outermost redex. The result is built
+         * in scratch, which is then swapped with target: the cells
+         * before and after the redex are block copies, the body is
+         * lowered and each occurrence of the variable is replaced by
+         * a raised copy of the argument. */
+        struct NormalOrder
+        {
+            NormalOrder() = delete;
+            static OutcomeKind Perform(std::vector<Cell> &target, std::vector<Cell> &scratch)
+            {
+                auto const cells = target.data();
+                auto const count = target.size();
+                auto const redex = Kernels::FindRedex(cells, count);
+                if (redex == Kernels::None)
+                {
+                    return Outcome::NormalForm;
+                }
+                auto const level = Cells::Level(cells[redex + 1]);
+                Cell bodyDepth = 0, argumentDepth = 0, occurrenceDepth = 0;
+                auto const bodyBegin = redex + 2;
+                auto const bodyEnd = Cells::End(cells, bodyBegin, bodyDepth);
+                auto const argumentEnd = Cells::End(cells, bodyEnd, argumentDepth);
+                auto const argumentCount = argumentEnd - bodyEnd;
+                auto const occurrences = Kernels::CountOccurrences(
+                    cells + bodyBegin, bodyEnd - bodyBegin, level, occurrenceDepth);
+                if (occurrences != 0
+                    && argumentDepth + (occurrenceDepth - 1 - level) > Cells::MaxDepth)
+                {
+                    return Outcome::TooDeep;
+                }
+                scratch.resize(count - (argumentEnd - redex)
+                    + (bodyEnd - bodyBegin - occurrences)
+                    + occurrences * argumentCount);
+                auto out = scratch.data();
+                std::memcpy(out, cells, redex * sizeof(Cell));
+                out += redex;
+                auto begin = bodyBegin;
+                for (size_t i = bodyBegin; occurrences != 0 && i != bodyEnd; ++i)
+                {
+                    if ((cells[i] & (Cells::TagMask | Cells::LevelMask)) != level)
+                    {
+                        continue;
+                    }
+                    Kernels::Lower(out, cells + begin, i - begin, level);
+                    out += i - begin;
+                    Kernels::Raise(out, cells + bodyEnd, argumentCount,
+                        level, Cells::Depth(cells[i]) - 1 - level);
+                    out += argumentCount;
+                    begin = i + 1;
+                }
+                Kernels::Lower(out, cells + begin, bodyEnd - begin, level);
+                out += bodyEnd - begin;
+                std::memcpy(out, cells + argumentEnd, (count - argumentEnd) * sizeof(Cell));
+                target.swap(scratch);
+                return Outcome::Reduced;
+            }
+        };
+    }
+}
+
+#endif // PACKED_HPP_
@@ -4,6 +4,19 @@
 #define PARSER_HPP_ 1
 
 #include"terms.hpp"
+#include<cstring>
+
+/* Define LAMBDA_CALCULUS_NO_SIMD to use the scalar loops only. */
+#if defined(__SSE2__) && !defined(LAMBDA_CALCULUS_NO_SIMD)
+#include<emmintrin.h>
+#define LAMBDA_CALCULUS_LEXER_SSE2 1
+#endif
+
+/* A new term from a string literal, checked at compile time (see
+ * DeBruijnIndex::Literal). */
+#define LAMBDA_LITERAL(source) \
+    (::DeBruijnIndex::Literal::Instantiate< \
+        ::DeBruijnIndex::Literal::Check(source)>(source))
 
 namespace DeBruijnIndex
 {
@@ -22,6 +35,14 @@ namespace DeBruijnIndex
             static constexpr TokenKind LambdaToken = 4;
             static constexpr TokenKind NamedObjectToken = 5;
             static constexpr TokenKind BoundVariableToken = 6;
+            static constexpr TokenKind NumeralToken = 7;
+            static constexpr TokenKind LetToken = 8;
+            static constexpr TokenKind InToken = 9;
+            /* The largest numeral literal. A Church numeral is as
+             * deep as its value, and the visitors recurse once per
+             * level, so deeper terms overflow a default stack of
+             * 8 MB in instrumented builds. */
+            static constexpr size_t MaxNumeral = 4096;
 
             TokenKind Kind;
             char const *Literal;
@@ -30,6 +51,11 @@ namespace DeBruijnIndex
             char const *ReasonIfInvalid;
         };
 
+        /* Characters are classified by a table, and long runs of
+         * whitespace or of identifier characters are skipped 16 at a
+         * time with SSE2 if available (define LAMBDA_CALCULUS_NO_SIMD
+         * to use the table only). The input is measured once, so the
+         * vector loads never read past its end. */
         struct TokenSource
         {
             TokenSource(TokenSource &&) = default;
@@ -38,14 +64,13 @@ namespace DeBruijnIndex
             TokenSource &operator = (TokenSource const &) = default;
             ~TokenSource() = default;
             explicit TokenSource(char const *in)
-                : input(in)
+                : input(in), end(in + std::strlen(in))
             {
                 DiscardCurrent();
             }
             void DiscardCurrent()
             {
-                for (; IsWhitespace(*input); ++input)
-                    ;
+                SkipWhitespace();
                 if (*input == '\0')
                 {
                     current = { Token::EndOfInputToken, input, 0 };
@@ -69,19 +94,12 @@ namespace DeBruijnIndex
                     current = { Token::LambdaToken, input - 1, 1 };
                     return;
                 }
-                if (StringStartsWith(input, "lambda")
-                    && !IsIdentifierFollowingChar(input[6]))
-                {
-                    input += 6;
-                    current = { Token::LambdaToken, input - 6, 6 };
-                    return;
-                }
                 if (IsIdentifierBeginChar(*input))
                 {
-                    auto begin = input;
-                    for (; IsIdentifierFollowingChar(*input); ++input)
-                        ;
-                    current = { Token::NamedObjectToken, begin, (size_t)(input - begin) };
+                    auto begin = input++;
+                    SkipIdentifier();
+                    auto const length = (size_t)(input - begin);
+                    current = { IdentifierKind(begin, length), begin, length };
                     return;
                 }
                 if (IsDigit(*input))
@@ -109,6 +127,31 @@ namespace DeBruijnIndex
                     current = { Token::BoundVariableToken, begin, (size_t)(input - begin), value };
                     return;
                 }
+                if (*input == '#')
+                {
+                    auto begin = input++;
+                    if (!IsDigit(*input))
+                    {
+                        current = { Token::InvalidToken, begin, 1, 0,
+                            "Numeral literal must have digits after #." };
+                        return;
+                    }
+                    size_t value = 0;
+                    for (; IsDigit(*input); ++input)
+                    {
+                        value = value * 10 + (*input - '0');
+                        if (value > Token::MaxNumeral)
+                        {
+                            for (; IsDigit(*input); ++input)
+                                ;
+                            current = { Token::InvalidToken, begin, (size_t)(input - begin),
+                                0, "Numeral literal too large (value > 4096)." };
+                            return;
+                        }
+                    }
+                    current = { Token::NumeralToken, begin, (size_t)(input - begin), value };
+                    return;
+                }
                 current = { Token::InvalidToken, input, 0, 0, "Unrecognised token." };
                 return;
             }
@@ -118,38 +161,386 @@ namespace DeBruijnIndex
             }
         private:
             char const *input;
+            char const *end;
             Token current;
+            static constexpr unsigned char WhitespaceClass = 1;
+            static constexpr unsigned char DigitClass = 2;
+            static constexpr unsigned char IdentifierBeginClass = 4;
+            static constexpr unsigned char IdentifierFollowingClass = 8;
+            struct CharacterTable
+            {
+                unsigned char Classes[256];
+                CharacterTable()
+                {
+                    for (unsigned i = 0; i != 256; ++i)
+                    {
+                        auto const ch = (char)i;
+                        bool const digit = ch >= '0' && ch <= '9';
+                        bool const begin = (ch >= 'A' && ch <= 'Z')
+                            || (ch >= 'a' && ch <= 'z')
+                            || StringContainsChar("~!$%^&*-+=|\\/<>?_", ch);
+                        Classes[i] = (unsigned char)(
+                            (StringContainsChar(" \t\v\b\r\n", ch) ? WhitespaceClass : 0)
+                            | (digit ? DigitClass : 0)
+                            | (begin ? IdentifierBeginClass : 0)
+                            | (digit || begin ? IdentifierFollowingClass : 0));
+                    }
+                }
+            };
+            static unsigned char ClassOf(char ch)
+            {
+                static CharacterTable const table;
+                return table.Classes[(unsigned char)ch];
+            }
             static bool StringContainsChar(char const *str, char ch)
             {
                 for (; *str && *str != ch; ++str)
                     ;
                 return *str;
             }
-            static bool StringStartsWith(char const *str, char const *pattern)
+            /* The keywords are identifiers that are not names. */
+            static TokenKind IdentifierKind(char const *begin, size_t length)
             {
-                for (; *pattern && *(pattern++) == *(str++); )
-                    ;
-                return !*pattern;
+                if (length == 6 && std::memcmp(begin, "lambda", 6) == 0)
+                {
+                    return Token::LambdaToken;
+                }
+                if (length == 3 && std::memcmp(begin, "let", 3) == 0)
+                {
+                    return Token::LetToken;
+                }
+                if (length == 2 && std::memcmp(begin, "in", 2) == 0)
+                {
+                    return Token::InToken;
+                }
+                return Token::NamedObjectToken;
             }
             static bool IsWhitespace(char ch)
             {
-                return StringContainsChar(" \t\v\b\r\n", ch);
+                return ClassOf(ch) & WhitespaceClass;
             }
             static bool IsDigit(char ch)
             {
-                return ch >= '0' && ch <= '9';
+                return ClassOf(ch) & DigitClass;
             }
             static bool IsIdentifierBeginChar(char ch)
             {
-                return (ch >= 'A' && ch <= 'Z')
-                    || (ch >= 'a' && ch <= 'z')
-                    || StringContainsChar("~!$%^&*-+=|\\/<>?_", ch);
+                return ClassOf(ch) & IdentifierBeginClass;
             }
             static bool IsIdentifierFollowingChar(char ch)
             {
-                return IsDigit(ch) || IsIdentifierBeginChar(ch);
+                return ClassOf(ch) & IdentifierFollowingClass;
+            }
+            /* Most runs are a single character, which is checked
+             * before trying the vector loop. */
+            void SkipWhitespace()
+            {
+                if (!IsWhitespace(*input))
+                {
+                    return;
+                }
+                ++input;
+#ifdef LAMBDA_CALCULUS_LEXER_SSE2
+                for (; end - input >= 16 && IsWhitespace(*input); input += 16)
+                {
+                    auto const chunk = _mm_loadu_si128((__m128i const *)input);
+                    auto const found = _mm_or_si128(
+                        InRange(chunk, '\b', '\v'),
+                        _mm_or_si128(
+                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')),
+                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' '))));
+                    if (Advance(found))
+                    {
+                        return;
+                    }
+                }
+#endif
+                for (; IsWhitespace(*input); ++input)
+                    ;
+            }
+            void SkipIdentifier()
+            {
+#ifdef LAMBDA_CALCULUS_LEXER_SSE2
+                for (; end - input >= 16 && IsIdentifierFollowingChar(*input); input += 16)
+                {
+                    auto const chunk = _mm_loadu_si128((__m128i const *)input);
+                    auto const letters = InRange(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+                    auto const ranges = _mm_or_si128(
+                        _mm_or_si128(InRange(chunk, '0', '9'), InRange(chunk, '$', '&')),
+                        _mm_or_si128(
+                            _mm_or_si128(InRange(chunk, '*', '+'), InRange(chunk, '<', '?')),
+                            InRange(chunk, '^', '_')));
+                    auto const singles = _mm_or_si128(
+                        _mm_or_si128(
+                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('!')),
+                            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('-'))),
+                        _mm_or_si128(
+                            _mm_or_si128(
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')),
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))),
+                            _mm_or_si128(
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('|')),
+                                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('~')))));
+                    auto const found = _mm_or_si128(letters, _mm_or_si128(ranges, singles));
+                    if (Advance(found))
+                    {
+                        return;
+                    }
+                }
+#endif
+                for (; IsIdentifierFollowingChar(*input); ++input)
+                    ;
+            }
+#ifdef LAMBDA_CALCULUS_LEXER_SSE2
+            /* Moves past the leading bytes found in the chunk at the
+             * input, and returns whether the run ends in it. */
+            bool Advance(__m128i found)
+            {
+                auto const missing = ~(unsigned)_mm_movemask_epi8(found) & 0xFFFF;
+                if (missing == 0)
+                {
+                    return false;
+                }
+                input += __builtin_ctz(missing);
+                return true;
+            }
+            /* The bytes from low to high, as unsigned characters. */
+            static __m128i InRange(__m128i chunk, char low, char high)
+            {
+                auto const width = _mm_set1_epi8((char)(high - low));
+                auto const offset = _mm_sub_epi8(chunk, _mm_set1_epi8(low));
+                return _mm_cmpeq_epi8(_mm_max_epu8(offset, width), width);
+            }
+#endif
+        };
+    }
+
+    /* Term literals, checked when the program is compiled, so that
+     * the terms embedded in the library need no parsing at run time.
+     * LAMBDA_LITERAL("...2(3 2 1)") is a new term, the same as the
+     * one Parser::Parse builds from the string. A literal that does
+     * not parse, or has a variable with no binder, does not compile,
+     * and the error points at the throw with the reason. Literals
+     * have abstractions, variables, numerals and parentheses, but
+     * no constants or let. The check recurses about once per token,
+     * so long literals may need a larger constexpr depth. */
+    namespace Literal
+    {
+        constexpr bool IsSpace(char ch)
+        {
+            return ch == ' ' || ch == '\t' || ch == '\v'
+                || ch == '\b' || ch == '\r' || ch == '\n';
+        }
+        constexpr bool IsDigit(char ch)
+        {
+            return ch >= '0' && ch <= '9';
+        }
+        constexpr bool Contains(char const *str, char ch)
+        {
+            return *str != '\0' && (*str == ch || Contains(str + 1, ch));
+        }
+        constexpr bool IsIdentifierFollowingChar(char ch)
+        {
+            return IsDigit(ch) || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z')
+                || (ch != '\0' && Contains("~!$%^&*-+=|\\/<>?_", ch));
+        }
+        constexpr bool StartsWith(char const *str, char const *pattern)
+        {
+            return *pattern == '\0' || (*str == *pattern && StartsWith(str + 1, pattern + 1));
+        }
+        /* The length of the lambda token at str, or 0. */
+        constexpr size_t LambdaLength(char const *str)
+        {
+            return *str == '.' ? 1
+                : StartsWith(str, "lambda") && !IsIdentifierFollowingChar(str[6]) ? 6
+                : 0;
+        }
+        constexpr size_t SkipSpaces(char const *str, size_t i)
+        {
+            return IsSpace(str[i]) ? SkipSpaces(str, i + 1) : i;
+        }
+        constexpr size_t SkipDigits(char const *str, size_t i)
+        {
+            return IsDigit(str[i]) ? SkipDigits(str, i + 1) : i;
+        }
+        /* Stops growing past the largest value allowed. */
+        constexpr size_t Value(char const *str, size_t i, size_t value)
+        {
+            return IsDigit(str[i])
+                ? Value(str, i + 1, value > 65536 ? value : value * 10 + (size_t)(str[i] - '0'))
+                : value;
+        }
+        constexpr size_t Items(char const *str, size_t i, size_t depth, bool empty);
+        constexpr size_t Closing(char const *str, size_t i)
+        {
+            return str[i] == ')' ? i + 1
+                : throw "Unexpected token. Expecting closing parenthesis.";
+        }
+        /* The end of the variable, numeral or parenthesised term at i. */
+        constexpr size_t Item(char const *str, size_t i, size_t depth)
+        {
+            return str[i] == '(' ? Closing(str, Items(str, i + 1, depth, true))
+                : str[i] == '#'
+                    ? (IsDigit(str[i + 1]) && Value(str, i + 1, 0) <= Lexer::Token::MaxNumeral
+                        ? SkipDigits(str, i + 1)
+                        : throw "Numerals are between #0 and #4096.")
+                : IsDigit(str[i])
+                    ? (Value(str, i, 0) >= 1 && Value(str, i, 0) <= depth
+                        ? SkipDigits(str, i)
+                        : throw "Stack overflow. Free variable is not supported.")
+                : throw "Unrecognised token. Literals have no constants or let.";
+        }
+        constexpr size_t ItemsAt(char const *str, size_t i, size_t depth, bool empty)
+        {
+            return str[i] == '\0' || str[i] == ')'
+                ? (empty ? throw "Unexpected token. Expecting a term." : i)
+                : LambdaLength(str + i) != 0
+                    ? Items(str, i + LambdaLength(str + i), depth + 1, true)
+                    : Items(str, Item(str, i, depth), depth, false);
+        }
+        /* The end of the term at i, in which depth variables are bound. */
+        constexpr size_t Items(char const *str, size_t i, size_t depth, bool empty)
+        {
+            return ItemsAt(str, SkipSpaces(str, i), depth, empty);
+        }
+        constexpr size_t Checked(char const *str, size_t end)
+        {
+            return str[end] == '\0' ? end
+                : throw "Unexpected token. Expecting end of input.";
+        }
+        /* The length of a literal that parses, only usable in constant
+         * expressions. */
+        constexpr size_t Check(char const *str)
+        {
+            return Checked(str, Items(str, 0, 0, true));
+        }
+
+        /* Builds the term of a checked literal, without lexing it into
+         * tokens or looking for errors. */
+        struct Instantiation
+        {
+            Instantiation() = delete;
+            Instantiation(Instantiation const &) = delete;
+            Instantiation(Instantiation &&) = delete;
+            Instantiation &operator = (Instantiation const &) = delete;
+            Instantiation &operator = (Instantiation &&) = delete;
+            ~Instantiation() = default;
+            explicit Instantiation(char const *input)
+                : input(input)
+            {
+            }
+            TermPtr Items()
+            {
+                TermPtr result;
+                for (;;)
+                {
+                    for (; IsSpace(*input); ++input)
+                        ;
+                    if (*input == '\0' || *input == ')')
+                    {
+                        return result;
+                    }
+                    TermPtr item;
+                    if (LambdaLength(input) != 0)
+                    {
+                        input += LambdaLength(input);
+                        Bind();
+                        auto body = Items();
+                        item = Unbind(std::move(body));
+                    }
+                    else if (*input == '(')
+                    {
+                        ++input;
+                        item = Items();
+                        ++input;
+                    }
+                    else if (*input == '#')
+                    {
+                        ++input;
+                        item = Numeral(Digits());
+                    }
+                    else
+                    {
+                        item = Variable(Digits());
+                    }
+                    if ((bool)result)
+                    {
+                        TermPtr application;
+                        application.NewInstance()->ApplicationConstructor(std::move(result), std::move(item));
+                        result = std::move(application);
+                    }
+                    else
+                    {
+                        result = std::move(item);
+                    }
+                }
+            }
+        private:
+            struct Binder
+            {
+                TermPtr Abstraction;
+                /* Created on the first occurrence. */
+                TermPtr Variable;
+            };
+            char const *input;
+            std::vector<Binder> binders;
+            size_t Digits()
+            {
+                size_t value = 0;
+                for (; IsDigit(*input); ++input)
+                {
+                    value = value * 10 + (size_t)(*input - '0');
+                }
+                return value;
+            }
+            void Bind()
+            {
+                binders.push_back(Binder());
+                binders.back().Abstraction.NewInstance();
+            }
+            TermPtr Unbind(TermPtr body)
+            {
+                auto abstraction = std::move(binders.back().Abstraction);
+                auto variable = std::move(binders.back().Variable);
+                binders.pop_back();
+                abstraction->AbstractionConstructor(std::move(variable), std::move(body));
+                return abstraction;
+            }
+            TermPtr Variable(size_t index)
+            {
+                auto &binder = binders[binders.size() - index];
+                if (!(bool)binder.Variable)
+                {
+                    binder.Variable.NewInstance()->BoundVariableConstructor(binder.Abstraction);
+                }
+                return binder.Variable;
+            }
+            /* ..2(2(...(2 1))), as ChurchEncoding::Numeral. */
+            TermPtr Numeral(size_t value)
+            {
+                Bind();
+                Bind();
+                auto body = Variable(1);
+                for (size_t i = 0; i != value; ++i)
+                {
+                    TermPtr application;
+                    application.NewInstance()->ApplicationConstructor(Variable(2), std::move(body));
+                    body = std::move(application);
+                }
+                auto inner = Unbind(std::move(body));
+                return Unbind(std::move(inner));
             }
         };
+
+        /* The nodes are allocated consecutively, from a region of the
+         * pool. Length is the length of source, as checked. */
+        template <size_t Length>
+        TermPtr Instantiate(char const (&source)[Length + 1])
+        {
+            Utilities::RefCountMemPool<LambdaCalculus::Term>::Region region;
+            Instantiation instantiation(source);
+            return instantiation.Items();
+        }
     }
 
     namespace Parser
@@ -166,10 +557,12 @@ namespace DeBruijnIndex
             AbstractionBoundStack &operator = (AbstractionBoundStack &&) = delete;
             ~AbstractionBoundStack() = delete;
             typedef MemPool::Entry *Pointer;
-            static Pointer Push(TermPtr entry, Pointer stack)
+            static Pointer Push(TermPtr entry, Pointer stack, bool let = false)
             {
                 auto result = MemPool::Default.Allocate();
                 result->Data.Entry.MoveConstructor(std::move(entry));
+                result->Data.Let = let;
+                result->Data.Variable.DefaultConstructor();
                 result->Data.LastEntry = stack;
                 return result;
             }
@@ -177,18 +570,101 @@ namespace DeBruijnIndex
             {
                 auto result = stack->Data.LastEntry;
                 stack->Data.Entry.Finalise();
+                stack->Data.Variable.Finalise();
                 MemPool::Default.Deallocate(stack);
                 return result;
             }
             void DefaultConstructor() { }
             void Finalise() { }
+            /* The abstraction, or the bound term if Let. */
             TermPtr Entry;
+            bool Let;
+            /* Created on the first occurrence. */
+            TermPtr Variable;
             Pointer LastEntry;
         };
 
+        /* Church encodings of the native terms. */
+        struct ChurchEncoding
+        {
+            ChurchEncoding() = delete;
+            /* Builds ..2(2(...(2 1))). */
+            static TermPtr Numeral(size_t value)
+            {
+                TermPtr outer, inner, outerVariable, innerVariable;
+                outer.NewInstance();
+                inner.NewInstance();
+                outerVariable.NewInstance()->BoundVariableConstructor(outer);
+                innerVariable.NewInstance()->BoundVariableConstructor(inner);
+                TermPtr body = innerVariable;
+                for (size_t i = 0; i != value; ++i)
+                {
+                    auto nested = std::move(body);
+                    body.NewInstance()->ApplicationConstructor(outerVariable, std::move(nested));
+                }
+                inner->AbstractionConstructor(std::move(innerVariable), std::move(body));
+                outer->AbstractionConstructor(std::move(outerVariable), std::move(inner));
+                return outer;
+            }
+            static TermPtr Boolean(bool value)
+            {
+                return value
+                    ? Cached(0, [] { return LAMBDA_LITERAL("..2"); })
+                    : Cached(1, [] { return LAMBDA_LITERAL("..1"); });
+            }
+            /* The Church form of a native combinator (not a numeral).
+             * The result is closed and shared, do not modify it. */
+            static TermPtr Operation(LambdaCalculus::NativeOperation operation)
+            {
+                typedef LambdaCalculus::Term Term;
+                switch (operation)
+                {
+                    case Term::NativeSuccessor:
+                        return Cached(2, [] { return LAMBDA_LITERAL("...2(3 2 1)"); });
+                    case Term::NativePredecessor:
+                        return Cached(3, [] { return LAMBDA_LITERAL("...3 (..1 (2 4)) (.2) (.1)"); });
+                    case Term::NativeIsZero:
+                        return Cached(4, [] { return LAMBDA_LITERAL(".1 (...1) (..2)"); });
+                    case Term::NativeAddition:
+                        return Cached(5, [] { return LAMBDA_LITERAL("....4 2 (3 2 1)"); });
+                    case Term::NativeMultiplication:
+                        return Cached(6, [] { return LAMBDA_LITERAL("...3(2 1)"); });
+                    default:
+                        return nullptr;
+                }
+            }
+        private:
+            static constexpr size_t CacheSize = 7;
+            static TermPtr *Cache()
+            {
+                static TermPtr cache[CacheSize];
+                return cache;
+            }
+            static void CacheRoots(std::vector<TermPtr const *> &roots)
+            {
+                for (size_t i = 0; i != CacheSize; ++i)
+                {
+                    roots.push_back(Cache() + i);
+                }
+            }
+            template <typename TBuild>
+            static TermPtr Cached(size_t index, TBuild &&build)
+            {
+                auto const cache = Cache();
+                if (!(bool)cache[index])
+                {
+                    cache[index] = build();
+                    LambdaCalculus::Term::AddRootSource(CacheRoots);
+                }
+                return cache[index];
+            }
+        };
+
         /*            Term -> ApplicationTerm* lambda Term
+         *            Term -> ApplicationTerm* let Term in Term
          *            Term -> ApplicationTerm+
-         * ApplicationTerm -> const | var | (Term)
+         * ApplicationTerm -> const | var | numeral | (Term)
+         * The keywords lambda, let and in are never const.
          */
         template <typename T>
         struct ParserImpl
@@ -232,6 +708,9 @@ namespace DeBruijnIndex
                     case Lexer::Token::LambdaToken:
                     case Lexer::Token::NamedObjectToken:
                     case Lexer::Token::BoundVariableToken:
+                    case Lexer::Token::NumeralToken:
+                    case Lexer::Token::LetToken:
+                    case Lexer::Token::InToken:
                         err = "Unexpected token. Expecting end of input.";
                         errpos = token.Literal;
                         return nullptr;
@@ -259,6 +738,7 @@ namespace DeBruijnIndex
                         /* Empty expression or Term -> ApplicationTerms+ */
                         case Lexer::Token::EndOfInputToken:
                         case Lexer::Token::RParenthesisToken:
+                        case Lexer::Token::InToken:
                         {
                             err = "(Sub)expression is empty.";
                             errpos = token.Literal;
@@ -282,10 +762,29 @@ namespace DeBruijnIndex
                             );
                             return result;
                         }
+                        /* Term -> ApplicationTerms* let Term in Term */
+                        case Lexer::Token::LetToken:
+                        {
+                            if (!(bool)application)
+                            {
+                                return ParseLetTerm();
+                            }
+                            TermPtr body = ParseLetTerm();
+                            if (!(bool)body)
+                            {
+                                return nullptr;
+                            }
+                            TermPtr result;
+                            result.NewInstance()->ApplicationConstructor(
+                                std::move(application), std::move(body)
+                            );
+                            return result;
+                        }
                         /* ApplicationTerm */
                         case Lexer::Token::LParenthesisToken:
                         case Lexer::Token::BoundVariableToken:
                         case Lexer::Token::NamedObjectToken:
+                        case Lexer::Token::NumeralToken:
                         {
                             if ((bool)application)
                             {
@@ -357,10 +856,24 @@ namespace DeBruijnIndex
                             errpos = token.Literal;
                             return nullptr;
                         }
-                        TermPtr result;
-                        result.NewInstance()->BoundVariableConstructor(boundBy->Data.Entry);
+                        if (boundBy->Data.Let)
+                        {
+                            src.DiscardCurrent();
+                            return boundBy->Data.Entry;
+                        }
+                        auto &variable = boundBy->Data.Variable;
+                        if (!(bool)variable)
+                        {
+                            variable.NewInstance()->BoundVariableConstructor(boundBy->Data.Entry);
+                        }
                         src.DiscardCurrent();
-                        return result;
+                        return variable;
+                    }
+                    /* ApplicationTerm -> numeral */
+                    case Lexer::Token::NumeralToken:
+                    {
+                        src.DiscardCurrent();
+                        return ChurchEncoding::Numeral(token.Value);
                     }
                     /* ApplicationTerm -> const */
                     case Lexer::Token::NamedObjectToken:
@@ -379,6 +892,8 @@ namespace DeBruijnIndex
                     case Lexer::Token::EndOfInputToken:
                     case Lexer::Token::RParenthesisToken:
                     case Lexer::Token::LambdaToken:
+                    case Lexer::Token::LetToken:
+                    case Lexer::Token::InToken:
                     {
                         err = "Internal parser error: unexpected call to ParseApplicationTerm at this token.";
                         errpos = token.Literal;
@@ -413,15 +928,40 @@ namespace DeBruijnIndex
                 result.NewInstance();
                 stack = AbstractionBoundStack::Push(result, stack);
                 auto abstractee = ParseTerm();
+                auto variable = std::move(stack->Data.Variable);
                 stack = AbstractionBoundStack::Pop(stack);
                 if ((bool)abstractee)
                 {
-                    result->AbstractionConstructor(std::move(abstractee));
+                    result->AbstractionConstructor(std::move(variable), std::move(abstractee));
                     return result;
                 }
                 return nullptr;
             }
 
+            /* The bound term is parsed once, and every variable bound
+             * by the let refers to it. */
+            TermPtr ParseLetTerm()
+            {
+                src.DiscardCurrent();
+                auto bound = ParseTerm();
+                if (!(bool)bound)
+                {
+                    return nullptr;
+                }
+                auto token = src.PeekCurrent();
+                if (token.Kind != Lexer::Token::InToken)
+                {
+                    err = "Unexpected token. Expecting in.";
+                    errpos = token.Literal;
+                    return nullptr;
+                }
+                src.DiscardCurrent();
+                stack = AbstractionBoundStack::Push(std::move(bound), stack, true);
+                auto body = ParseTerm();
+                stack = AbstractionBoundStack::Pop(stack);
+                return body;
+            }
+
         };
 
         template <typename T>
@@ -435,6 +975,37 @@ namespace DeBruijnIndex
             errpos = helper.errpos;
             return (bool)result;
         }
+
+        /* Parses a term in which name refers to the term itself
+         * (letrec). The occurrences of name are a shared reference
+         * term tied to the result by a weak edge, so the caller must
+         * keep the result alive for as long as the references may be
+         * used. The name must outlive the result. */
+        template <typename T>
+        bool ParseRecursive(char const *input, char const *name, TermPtr &result,
+            char const *&err, char const *&errpos,
+            T &&constants)
+        {
+            TermPtr reference;
+            reference.NewInstance()->ReferenceConstructor(name);
+            auto const length = std::strlen(name);
+            auto recursive = [&](char const *identifier, int identifierLength) -> TermPtr
+            {
+                if ((size_t)identifierLength == length
+                    && std::strncmp(identifier, name, length) == 0)
+                {
+                    return reference;
+                }
+                return constants(identifier, identifierLength);
+            };
+            if (!Parse(input, result, err, errpos, recursive))
+            {
+                return false;
+            }
+            reference->Tie(result);
+            return true;
+        }
+
     }
 }
 
@@ -1,10 +1,13 @@
 #include"terms.hpp"
 #include"parser.hpp"
 #include"reducer.hpp"
+#include"spill.hpp"
 #include<cstdio>
 #include"toys/toy.hpp"
+#include<list>
 #include<map>
 #include<string>
+#include<chrono>
 
 using namespace DeBruijnIndex::Parser;
 using namespace LambdaCalculus::Reduction;
@@ -28,31 +31,202 @@ struct SavedEntriesTag
     {
         entries[name] = ptr;
     }
+    /* The entry must be set by ReplaceEntry if it is not the
+     * result of the session, so that the session is discarded. */
+    void ReplaceEntry(std::string const &name, TermPtr const &ptr) const
+    {
+        sessions.erase(name);
+        AddEntry(name, ptr);
+    }
+    ReductionSession &LookupSession(std::string const &name) const
+    {
+        return sessions[name];
+    }
     TermPtr LookupEntry(std::string const &name) const
     {
         auto found = entries.find(name);
         return found == entries.end() ? nullptr : found->second;
     }
+    /* A recursive definition is referred to weakly by its own
+     * references, which may be copied into any term, so it is kept
+     * until exit, together with the name the references print. */
+    std::pair<std::string, TermPtr> &KeepRecursive(std::string const &name) const
+    {
+        recursives.emplace_back(name, nullptr);
+        return recursives.back();
+    }
+    void DiscardLastRecursive() const
+    {
+        recursives.pop_back();
+    }
     void ClearEntries() const
     {
         entries.clear();
+        sessions.clear();
+        recursives.clear();
     }
+    /* A Term::RootSource for the entries and recursive definitions. */
+    static void Roots(std::vector<TermPtr const *> &roots)
+    {
+        for (auto const &entry : entries)
+        {
+            roots.push_back(&entry.second);
+        }
+        for (auto const &recursive : recursives)
+        {
+            roots.push_back(&recursive.second);
+        }
+    }
+private:
+    static std::map<std::string, ReductionSession> sessions;
+    static std::list<std::pair<std::string, TermPtr>> recursives;
 } const SavedEntries;
 std::map<std::string, TermPtr> SavedEntriesTag::entries;
+std::map<std::string, ReductionSession> SavedEntriesTag::sessions;
+std::list<std::pair<std::string, TermPtr>> SavedEntriesTag::recursives;
 
 char buffer_short[1024];
 char buffer[8192];
-std::string const commands[] = { "set", "reduce", "print", "echo", "exit" };
+std::string const commands[] = { "set", "reduce", "print", "echo", "exit", "setrec", "compact", "spill", "equal" };
 #define CMD_SET 0
 #define CMD_REDUCE 1
 #define CMD_PRINT 2
 #define CMD_ECHO 3
 #define CMD_EXIT 4
+#define CMD_SETREC 5
+#define CMD_COMPACT 6
+#define CMD_SPILL 7
+#define CMD_EQUAL 8
+
+/* Reads the next whitespace-separated option into option,
+ * which must be able to hold 1024 characters. */
+bool NextOption(char const *&options, char *option)
+{
+    for (; *options == ' ' || *options == '\t'; ++options)
+        ;
+    if (*options == '\0')
+    {
+        return false;
+    }
+    size_t length = 0;
+    for (; *options && *options != ' ' && *options != '\t'; ++options)
+    {
+        if (length != 1023)
+        {
+            option[length++] = *options;
+        }
+    }
+    option[length] = '\0';
+    return true;
+}
+
+/* Recognises eta=step, eta=end and eta=off. */
+bool ParseEtaOption(char const *option, EtaPolicyKind &eta)
+{
+    std::string const value = option;
+    if (value == "eta=step")
+    {
+        eta = EtaPolicy::EveryStep;
+        return true;
+    }
+    if (value == "eta=end")
+    {
+        eta = EtaPolicy::AtEnd;
+        return true;
+    }
+    if (value == "eta=off")
+    {
+        eta = EtaPolicy::Never;
+        return true;
+    }
+    return false;
+}
+
+/* Recognises steps=<count>, time=<milliseconds> and nodes=<count>,
+ * where 0 means unlimited. */
+bool ParseBudgetOption(char const *option, Budget &budget)
+{
+    unsigned long long count;
+    double milliseconds;
+    char trailing;
+    if (sscanf(option, "steps=%llu%c", &count, &trailing) == 1)
+    {
+        budget.MaxSteps = (size_t)count;
+        return true;
+    }
+    if (sscanf(option, "time=%lf%c", &milliseconds, &trailing) == 1)
+    {
+        budget.MaxMilliseconds = milliseconds;
+        return true;
+    }
+    if (sscanf(option, "nodes=%llu%c", &count, &trailing) == 1)
+    {
+        budget.MaxLiveNodes = (size_t)count;
+        return true;
+    }
+    return false;
+}
+
+/* Percentage of far links in a reduced term from which all the
+ * entries are compacted, or 0 for never. */
+unsigned AutoCompact = 0;
+
+typedef std::chrono::steady_clock Clock;
+
+/* Measures all the entries, returning the shortest time taken
+ * by a few rounds. */
+double MeasureEntries(Compaction::Layout &total)
+{
+    double fastest = 0;
+    for (int round = 0; round != 5; ++round)
+    {
+        total = { 0, 0, 0 };
+        auto const started = Clock::now();
+        for (auto const &entry : SavedEntriesTag::entries)
+        {
+            auto const layout = Compaction::Measure(entry.second);
+            total.Nodes += layout.Nodes;
+            total.Links += layout.Links;
+            total.FarLinks += layout.FarLinks;
+        }
+        double const taken = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+        fastest = round == 0 || taken < fastest ? taken : fastest;
+    }
+    return fastest;
+}
+
+/* Relocates all the entries together, so that they still share
+ * their common parts, and reports the traversal times. */
+void CompactEntries(char const *reason)
+{
+    Compaction::Layout before, after;
+    double const measuredBefore = MeasureEntries(before);
+    auto const started = Clock::now();
+    size_t relocated;
+    {
+        Compaction compaction;
+        for (auto &entry : SavedEntriesTag::entries)
+        {
+            entry.second = compaction.Relocate(entry.second);
+        }
+        relocated = compaction.RelocatedCount();
+    }
+    double const compacted = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+    double const measuredAfter = MeasureEntries(after);
+    fprintf(stderr, "Info: %s: %zu nodes relocated in %.3f ms; traversing %zu nodes took %.3f ms before, %.3f ms after; far links %.1f%% before, %.1f%% after.\n",
+        reason, relocated, compacted, after.Nodes, measuredBefore, measuredAfter,
+        before.Links == 0 ? 0.0 : 100.0 * before.FarLinks / before.Links,
+        after.Links == 0 ? 0.0 : 100.0 * after.FarLinks / after.Links);
+}
 
 int main()
 {
+    LambdaCalculus::Term::AddRootSource(SavedEntriesTag::Roots);
     while (true)
     {
+        /* Between commands, the saved identifiers hold every term.
+         * Within a command, only the steps of reduce collect. */
+        TracingCollector::MaybeCollect(nullptr);
         if (scanf("%s", buffer_short) != 1)
         {
             break;
@@ -67,25 +241,241 @@ int main()
                 PutParserError(buffer, err, errpos);
                 continue;
             }
-            SavedEntries.AddEntry(buffer_short, result);
+            SavedEntries.ReplaceEntry(buffer_short, result);
+            continue;
+        }
+        if (buffer_short == commands[CMD_SETREC])
+        {
+            scanf("%s%[^\n]", buffer_short, buffer);
+            char const *err, *errpos;
+            auto &recursive = SavedEntries.KeepRecursive(buffer_short);
+            if (!ParseRecursive(buffer, recursive.first.c_str(), recursive.second,
+                err, errpos, SavedEntries))
+            {
+                PutParserError(buffer, err, errpos);
+                SavedEntries.DiscardLastRecursive();
+                continue;
+            }
+            /* The entry is a copy, since reductions rewrite the
+             * nodes of the entries in place, and the definition must
+             * stay as it is for the references to unfold it. */
+            Compaction compaction;
+            SavedEntries.ReplaceEntry(buffer_short, compaction.Relocate(recursive.second));
             continue;
         }
         if (buffer_short == commands[CMD_REDUCE])
         {
-            scanf("%s", buffer_short);
+            buffer[0] = '\0';
+            scanf("%s%[^\n]", buffer_short, buffer);
             auto result = SavedEntries.LookupEntry(buffer_short);
             if (!(bool)result)
             {
                 fprintf(stderr, "Error: identifier %s not found.\n", buffer_short);
                 continue;
             }
-            for (int i = 0;
-                i != 65536
-                && (EtaConversion::Perform(result)
-                    || BetaReduction::Perform(result));
-                ++i)
-                ;
+            StrategyKind strategy = Strategy::NormalOrder;
+            EtaPolicyKind eta = EtaPolicy::EveryStep;
+            bool native = false;
+            bool evaluate = false;
+            InstantiationKind instantiation = Instantiation::Copy;
+            bool isolate = false;
+            bool detect = false;
+            Budget budget = { 65536, 0, 0 };
+            bool optionsOkay = true;
+            char const *options = buffer;
+            char option[1024];
+            while (NextOption(options, option))
+            {
+                if (std::string(option) == "native")
+                {
+                    native = true;
+                }
+                else if (std::string(option) == "nbe")
+                {
+                    evaluate = true;
+                }
+                else if (std::string(option) == "templates")
+                {
+                    instantiation = Instantiation::Compiled;
+                }
+                else if (std::string(option) == "subst")
+                {
+                    instantiation = Instantiation::Explicit;
+                }
+                else if (std::string(option) == "cow")
+                {
+                    isolate = true;
+                }
+                else if (std::string(option) == "detect")
+                {
+                    detect = true;
+                }
+                else if (!Strategy::FromName(option, strategy)
+                    && !ParseEtaOption(option, eta)
+                    && !ParseBudgetOption(option, budget))
+                {
+                    fprintf(stderr, "Error: unrecognised option %s.\n", option);
+                    optionsOkay = false;
+                }
+            }
+            if (optionsOkay && evaluate
+                && (strategy != Strategy::NormalOrder || native))
+            {
+                fprintf(stderr, "Error: nbe only computes normal forms, without native.\n");
+                optionsOkay = false;
+            }
+            if (!optionsOkay)
+            {
+                continue;
+            }
+            auto &session = SavedEntries.LookupSession(buffer_short);
+            /* A session only resumes with the same options, but
+             * the budgets may differ. */
+            if (session.UsedStrategy != strategy
+                || session.Eta != eta
+                || session.Native != native
+                || session.Evaluate != evaluate
+                || session.Instantiate != instantiation
+                || session.Isolate != isolate
+                || session.Detect != detect)
+            {
+                session.Reset(strategy);
+            }
+            session.Eta = eta;
+            session.Native = native;
+            session.Evaluate = evaluate;
+            session.Instantiate = instantiation;
+            session.Isolate = isolate;
+            session.Detect = detect;
+            /* Evaluation starts over every time. */
+            bool const resumed = !evaluate && session.LastStatus != Status::NotStarted;
+#ifdef UTILITIES_COUNT_REFERENCES
+            size_t const changes = Utilities::ReferenceCounter::Changes();
+#endif
+            auto const status = session.Run(result, budget);
             SavedEntries.AddEntry(buffer_short, result);
+            fprintf(stderr, "Info: %s %s (%s): %s after %zu steps (%zu in total), %zu nodes allocated (%zu in total), %.3f ms (%.3f ms in total).\n",
+                resumed ? "resumed" : "reduced",
+                buffer_short, evaluate ? "nbe" : Strategy::Name(strategy), Status::Describe(status),
+                session.LastSteps, session.TotalSteps,
+                session.LastAllocations, session.TotalAllocations,
+                session.LastMilliseconds, session.TotalMilliseconds);
+            if (status == Status::Diverges)
+            {
+                fprintf(stderr, "Info: the term repeats every %zu steps.\n", session.CycleLength);
+            }
+#ifdef LAMBDA_CALCULUS_TRACING_GC
+            auto const &collected = TracingCollector::Totals();
+            fprintf(stderr, "Info: %zu collections so far freed %zu nodes, pausing %.3f ms at most and %.3f ms in total.\n",
+                collected.Collections, collected.Freed,
+                collected.MaxMilliseconds, collected.TotalMilliseconds);
+#endif
+#ifdef UTILITIES_COUNT_REFERENCES
+            fprintf(stderr, "Info: %zu reference counts changed (%.1f per step).\n",
+                Utilities::ReferenceCounter::Changes() - changes,
+                (double)(Utilities::ReferenceCounter::Changes() - changes) / (double)(session.LastSteps != 0 ? session.LastSteps : 1));
+#endif
+            if (Utilities::SpillFile::Size() != 0)
+            {
+                fprintf(stderr, "Info: %zu KB of %zu KB of the spill file used.\n",
+                    Utilities::SpillFile::Used() >> 10, Utilities::SpillFile::Size() >> 10);
+            }
+            if (AutoCompact != 0)
+            {
+                auto const layout = Compaction::Measure(result);
+                if (layout.FarLinks * 100 >= AutoCompact * layout.Links && layout.Links != 0)
+                {
+                    CompactEntries("compacted automatically");
+                }
+            }
+            continue;
+        }
+        if (buffer_short == commands[CMD_COMPACT])
+        {
+            buffer[0] = '\0';
+            scanf("%[^\n]", buffer);
+            char const *options = buffer;
+            char option[1024];
+            unsigned percent;
+            char trailing;
+            if (!NextOption(options, option))
+            {
+                CompactEntries("compacted");
+            }
+            else if (sscanf(option, "auto=%u%c", &percent, &trailing) == 1 && percent <= 100
+                && !NextOption(options, option))
+            {
+                AutoCompact = percent;
+            }
+            else
+            {
+                fprintf(stderr, "Error: unrecognised option %s.\n", option);
+            }
+            continue;
+        }
+        if (buffer_short == commands[CMD_SPILL])
+        {
+            buffer[0] = '\0';
+            scanf("%[^\n]", buffer);
+            unsigned long long megabytes;
+            char trailing;
+            char const *err;
+            if (sscanf(buffer, "%1023s%llu %c", buffer_short, &megabytes, &trailing) != 2
+                || megabytes == 0)
+            {
+                fputs("Error: expecting spill <directory> <megabytes>.\n", stderr);
+                continue;
+            }
+            if (!Utilities::SpillFile::Open(buffer_short, (size_t)megabytes << 20, err))
+            {
+                fprintf(stderr, "Error: %s\n", err);
+                continue;
+            }
+            Utilities::RefCountMemPool<Term>::Default.SetBlockSource(&Utilities::SpillFile::Allocate);
+            Utilities::RefCountMemPool<Term::Binding>::Default.SetBlockSource(&Utilities::SpillFile::Allocate);
+            continue;
+        }
+        if (buffer_short == commands[CMD_EQUAL])
+        {
+            buffer[0] = '\0';
+            scanf("%s%[^\n]", buffer_short, buffer);
+            std::string const left = buffer_short;
+            char const *options = buffer;
+            char option[1024];
+            if (!NextOption(options, option))
+            {
+                fputs("Error: expecting equal <identifier> <identifier>.\n", stderr);
+                continue;
+            }
+            std::string const right = option;
+            auto const leftTerm = SavedEntries.LookupEntry(left);
+            auto const rightTerm = SavedEntries.LookupEntry(right);
+            if (!(bool)leftTerm || !(bool)rightTerm)
+            {
+                fprintf(stderr, "Error: identifier %s not found.\n", (bool)leftTerm ? right.c_str() : left.c_str());
+                continue;
+            }
+            Budget budget = { 65536, 0, 0 };
+            bool optionsOkay = true;
+            while (NextOption(options, option))
+            {
+                if (!ParseBudgetOption(option, budget))
+                {
+                    fprintf(stderr, "Error: unrecognised option %s.\n", option);
+                    optionsOkay = false;
+                }
+            }
+            if (!optionsOkay)
+            {
+                continue;
+            }
+            size_t steps;
+            auto const started = Clock::now();
+            auto const answer = BetaEtaEquivalence::Perform(leftTerm, rightTerm, budget, steps);
+            puts(Answer::Describe(answer));
+            fprintf(stderr, "Info: compared %s and %s: %s after %zu steps, %.3f ms.\n",
+                left.c_str(), right.c_str(), Answer::Describe(answer), steps,
+                std::chrono::duration<double, std::milli>(Clock::now() - started).count());
             continue;
         }
         if (buffer_short == commands[CMD_PRINT])
@@ -125,5 +515,6 @@ int main()
     /* Release stored TermPtrs to prevent
      * too-late destruction. */
     SavedEntries.ClearEntries();
+    TracingCollector::ReleaseAll();
     return 0;
 }
@@ -4,106 +4,70 @@
 #define REDUCER_HPP_ 1
 
 #include"terms.hpp"
+#include"parser.hpp"
+#include<algorithm>
 #include<cstdio>
+#include<cstring>
+#include<chrono>
+#include<deque>
+#include<map>
+#include<vector>
 
 namespace LambdaCalculus
 {
     namespace Reduction
     {
         typedef Term::Pointer TermPtr;
+        typedef Term::BorrowedPointer BorrowedTermPtr;
 
-        struct EtaConversion : Term::Visitor<EtaConversion, bool (TermPtr &, TermPtr const &)>
+        /* Decides whether target can be shared, instead of copied,
+         * when the variable of binder is substituted in a tree that
+         * contains target: none of its free variables may be bound
+         * by binder or by an abstraction inside the tree, which are
+         * exactly the abstractions tagged with TMemoisation during
+         * the copy. If the summary is stale, a binder in it might no
+         * longer be a live abstraction, but then it does not occur
+         * in target, and a wrong answer only means an unnecessary
+         * copy. */
+        template <typename TMemoisation>
+        bool IsUnaffected(TermPtr const &target, Term const *binder)
         {
-            friend struct Term::Visitor<EtaConversion, bool (TermPtr &, TermPtr const &)>;
-            static bool Perform(TermPtr &target)
-            {
-                TermPtr surrogate = target;
-                EtaConversion instance;
-                instance.dirty = false;
-                instance.VisitTerm(target, nullptr);
-                surrogate->RecursivelyClearTag();
-                return instance.dirty;
-            }
-        private:
-            typedef Utilities::PodSurrogate<bool> Memoisation;
-            EtaConversion() = default;
-            EtaConversion(EtaConversion const &) = default;
-            EtaConversion(EtaConversion &&) = default;
-            EtaConversion &operator = (EtaConversion const &) = default;
-            EtaConversion &operator = (EtaConversion &&) = default;
-            ~EtaConversion() = default;
-            bool dirty;
-            bool VisitInvalidTerm(TermPtr &, TermPtr const &)
-            {
-                return false;
-            }
-            bool VisitInternalErrorTerm(TermPtr &, TermPtr const &)
+            if (target->FreeBinderCount > Term::MaxFreeBinders)
             {
                 return false;
             }
-            bool VisitBoundVariableTerm(TermPtr &target, TermPtr const &bound)
-            {
-                return (target->AsBoundVariable.BoundBy == bound);
-            }
-            bool VisitAbstractionTerm(TermPtr &target, TermPtr const &bound)
+            for (unsigned i = 0; i != target->FreeBinderCount; ++i)
             {
-                auto &body = target->AsAbstraction.Result;
-                bool const result = VisitTerm(body, bound);
-                if (!(bool)target->Tag)
+                auto const free = target->FreeBinders[i];
+                if (free == binder || free->Tag.Is<TMemoisation>())
                 {
-                    auto &memoised = target->Tag.NewInstance<Memoisation>()->Value;
-                    memoised = false;
-                    if (body->Kind != Term::ApplicationTerm)
-                    {
-                        return result;
-                    }
-                    auto &func = body->AsApplication.Function;
-                    auto &rplc = body->AsApplication.Replaced;
-                    if (rplc->Kind != Term::BoundVariableTerm)
-                    {
-                        return result;
-                    }
-                    if (rplc->AsBoundVariable.BoundBy != target)
-                    {
-                        return result;
-                    }
-                    if (VisitTerm(func, target))
-                    {
-                        return result;
-                    }
-                    dirty = true;
-                    memoised = true;
-                    target = func;
-                    return result;
-                }
-                if (target->Tag.RawPtrUnsafe<Memoisation>()->Value)
-                {
-                    target = body->AsApplication.Function;
+                    return false;
                 }
-                return result;
             }
-            bool VisitApplicationTerm(TermPtr &target, TermPtr const &bound)
-            {
-                auto &func = target->AsApplication.Function;
-                auto &rplc = target->AsApplication.Replaced;
-                return VisitTerm(func, bound) | VisitTerm(rplc, bound);
-            }
-        };
+            return true;
+        }
 
         struct DeepCloneAndReplace : Term::Visitor<DeepCloneAndReplace, TermPtr (TermPtr const &)>
         {
             friend struct Term::Visitor<DeepCloneAndReplace, TermPtr (TermPtr const &)>;
             static TermPtr Perform(TermPtr const &target, TermPtr const &bound, TermPtr const &replaced)
             {
+                Utilities::RefCountMemPool<Memoisation>::Region region;
                 DeepCloneAndReplace instance(bound, replaced);
                 auto result = instance.VisitTerm(target);
                 target->RecursivelyClearTag();
                 return result;
             }
         private:
+            /* The copy is owned by its parent in the copy, or by the
+             * caller for the root, and the memoisation only borrows
+             * it, so that it is handed over without touching the
+             * reference count. If a copy fails, nothing more is
+             * visited, so no borrowed copy is used after its owner
+             * dropped it. */
             struct Memoisation
             {
-                TermPtr Cloned;
+                BorrowedTermPtr Cloned;
                 Memoisation() = delete;
                 Memoisation(Memoisation const &) = delete;
                 Memoisation(Memoisation &&) = delete;
@@ -115,7 +79,6 @@ namespace LambdaCalculus
                 }
                 void Finalise()
                 {
-                    Cloned.Finalise();
                 }
             };
             DeepCloneAndReplace(TermPtr const &bound, TermPtr const &replaced)
@@ -128,6 +91,14 @@ namespace LambdaCalculus
             ~DeepCloneAndReplace() = default;
             TermPtr const &bound;
             TermPtr const &replaced;
+            bool Unaffected(TermPtr const &target)
+            {
+                return IsUnaffected<Memoisation>(target, bound.RawPtr());
+            }
+            static TermPtr Memoised(TermPtr const &target)
+            {
+                return target->Tag.RawPtrUnsafe<Memoisation>()->Cloned.Own();
+            }
             TermPtr VisitInvalidTerm(TermPtr const &)
             {
                 return nullptr;
@@ -143,84 +114,510 @@ namespace LambdaCalculus
                 {
                     return replaced;
                 }
-                if (!(bool)target->Tag)
+                /* Case 1: variable is not bound in the cloned tree. */
+                if (Unaffected(target))
                 {
-                    /* Case 1: variable is not bound in the cloned tree. */
-                    if (!boundBy->Tag.Is<Memoisation>())
-                    {
-                        target->Tag.NewInstance<Memoisation>()->Cloned = target;
-                    }
-                    /* Case 2: variable is bound in the cloned tree. */
-                    else
-                    {
-                        target->Tag.NewInstance<Memoisation>()
-                            ->Cloned.NewInstance()
-                            ->BoundVariableConstructor(
-                                boundBy->Tag.RawPtrUnsafe<Memoisation>()->Cloned
-                            );
-                    }
+                    return target;
+                }
+                /* Case 2: variable is bound in the cloned tree. */
+                if ((bool)target->Tag)
+                {
+                    return Memoised(target);
                 }
-                return target->Tag.RawPtrUnsafe<Memoisation>()->Cloned;
+                TermPtr clonedVariable;
+                clonedVariable.NewInstance()->BoundVariableConstructor(
+                    boundBy->Tag.RawPtrUnsafe<Memoisation>()->Cloned
+                );
+                target->Tag.NewInstance<Memoisation>()->Cloned = clonedVariable;
+                return clonedVariable;
+            }
+            TermPtr VisitNativeTerm(TermPtr const &target)
+            {
+                /* Native terms are closed. */
+                return target;
+            }
+            TermPtr VisitReferenceTerm(TermPtr const &target)
+            {
+                return target;
             }
             TermPtr VisitAbstractionTerm(TermPtr const &target)
             {
-                if (!(bool)target->Tag)
+                if (Unaffected(target))
+                {
+                    return target;
+                }
+                if ((bool)target->Tag)
+                {
+                    return Memoised(target);
+                }
+                TermPtr clonedAbstraction;
+                clonedAbstraction.NewInstance();
+                auto &memoised = target->Tag.NewInstance<Memoisation>()->Cloned;
+                memoised = clonedAbstraction;
+                auto clonedResult = VisitTerm(target->AsAbstraction.Result);
+                if (!(bool)clonedResult)
+                {
+                    memoised = nullptr;
+                    return nullptr;
+                }
+                /* The variable is cloned with its first occurrence. */
+                auto const &variable = target->AsAbstraction.Variable;
+                TermPtr clonedVariable;
+                if ((bool)variable && variable->Tag.Is<Memoisation>())
+                {
+                    clonedVariable = Memoised(variable);
+                }
+                clonedAbstraction->AbstractionConstructor(
+                    std::move(clonedVariable), std::move(clonedResult)
+                );
+                return clonedAbstraction;
+            }
+            TermPtr VisitApplicationTerm(TermPtr const &target)
+            {
+                if (Unaffected(target))
+                {
+                    return target;
+                }
+                if ((bool)target->Tag)
+                {
+                    return Memoised(target);
+                }
+                auto clonedFunc = VisitTerm(target->AsApplication.Function);
+                auto clonedRplc = (bool)clonedFunc
+                    ? VisitTerm(target->AsApplication.Replaced)
+                    : nullptr;
+                auto memoised = target->Tag.NewInstance<Memoisation>();
+                TermPtr clonedApplication;
+                if ((bool)clonedRplc)
+                {
+                    clonedApplication.NewInstance()
+                        ->ApplicationConstructor(
+                            std::move(clonedFunc), std::move(clonedRplc)
+                        );
+                    memoised->Cloned = clonedApplication;
+                }
+                return clonedApplication;
+            }
+        };
+
+        typedef unsigned ChildKind;
+
+        /* Rewriting of terms whose nodes may also belong to other
+         * terms (copy-on-write). A rewrite is located by the path of
+         * children from the root, and the nodes on the path that are
+         * referenced more than once are copied before the rewrite,
+         * so that only the copies are changed. The nodes off the
+         * path are still shared. */
+        struct CopyOnWrite
+        {
+            static constexpr ChildKind Function = 0;
+            static constexpr ChildKind Replaced = 1;
+            static constexpr ChildKind Result = 2;
+
+            /* Copies the shared nodes on the path from root, and
+             * returns the slot at the end of the path, which can then
+             * be assigned without affecting other terms. The node in
+             * that slot is not copied. */
+            static TermPtr &Unshare(TermPtr &root, std::vector<ChildKind> const &path)
+            {
+                TermPtr *slot = &root;
+                for (auto const child : path)
                 {
-                    auto &clonedAbstraction = target->Tag.NewInstance<Memoisation>()->Cloned;
-                    clonedAbstraction.NewInstance();
-                    auto clonedResult = VisitTerm(target->AsAbstraction.Result);
-                    if ((bool)clonedResult)
+                    auto &node = Term::Expose(*slot);
+                    /* Traced terms have no counts, so any might be shared. */
+                    if (Term::Traced || node.ReferenceCount() > 1)
                     {
-                        clonedAbstraction->AbstractionConstructor(std::move(clonedResult));
+                        node = Copy(node);
                     }
-                    else
+                    slot = &Child(node, child);
+                }
+                return Term::Expose(*slot);
+            }
+            static TermPtr &Child(TermPtr const &node, ChildKind child)
+            {
+                switch (child)
+                {
+                    case Function:
+                        return node->AsApplication.Function;
+                    case Replaced:
+                        return node->AsApplication.Replaced;
+                    default:
+                        return node->AsAbstraction.Result;
+                }
+            }
+        private:
+            /* Copies an application or an abstraction. The copy of an
+             * abstraction binds a new variable, so its body is copied
+             * as far as it refers to the variable. */
+            static TermPtr Copy(TermPtr const &target)
+            {
+                TermPtr result;
+                result.NewInstance();
+                if (target->Kind == Term::ApplicationTerm)
+                {
+                    result->ApplicationConstructor(
+                        target->AsApplication.Function,
+                        target->AsApplication.Replaced);
+                }
+                else if (!(bool)target->AsAbstraction.Variable)
+                {
+                    result->AbstractionConstructor(nullptr, target->AsAbstraction.Result);
+                }
+                else
+                {
+                    TermPtr variable;
+                    variable.NewInstance()->BoundVariableConstructor(result);
+                    auto body = DeepCloneAndReplace::Perform(
+                        target->AsAbstraction.Result, target, variable);
+                    result->AbstractionConstructor(std::move(variable), std::move(body));
+                }
+                result->Normal = target->Normal;
+                return result;
+            }
+        };
+
+        /* Copies term graphs into consecutive entries of the pool
+         * (a region promoted when the compaction ends), in depth-first
+         * order, so that traversals of the copies touch memory in
+         * order instead of in the order the entries were freed. The
+         * sharing among all the terms relocated by one instance is
+         * preserved. Indirections are skipped and substitutions are
+         * pushed down. References are not copied unless asked for,
+         * so the recursive definitions stay where they are. The
+         * original nodes are freed when nothing else refers to them. */
+        struct Compaction : Term::Visitor<Compaction, TermPtr (TermPtr const &)>
+        {
+            friend struct Term::Visitor<Compaction, TermPtr (TermPtr const &)>;
+            /* With references, each reference is copied as well, and
+             * tied to the copy of its target, which only the copy of
+             * the reference refers to (weakly), so the caller must
+             * keep it before the compaction ends (see References). */
+            explicit Compaction(bool references = false)
+                : references(references)
+            { }
+            Compaction(Compaction const &) = delete;
+            Compaction(Compaction &&) = delete;
+            Compaction &operator = (Compaction const &) = delete;
+            Compaction &operator = (Compaction &&) = delete;
+            ~Compaction()
+            {
+                for (auto const &original : originals)
+                {
+                    original->Tag = nullptr;
+                }
+            }
+            /* The copy of target, the same for every call. */
+            TermPtr Relocate(TermPtr const &target)
+            {
+                return VisitTerm(target);
+            }
+            size_t RelocatedCount() const
+            {
+                return originals.size();
+            }
+            /* The copied references, each with its original. */
+            std::vector<std::pair<TermPtr, TermPtr>> const &References() const
+            {
+                return copiedReferences;
+            }
+
+            struct Layout
+            {
+                size_t Nodes;
+                /* Links from a node to a child other than a variable,
+                 * and those to a child more than a page away. */
+                size_t Links, FarLinks;
+            };
+            /* Visits every node of target once, measuring how far
+             * the children are from their parents. */
+            static Layout Measure(TermPtr const &target)
+            {
+                Utilities::RefCountMemPool<MeasuredTag>::Region region;
+                Layout layout = { 0, 0, 0 };
+                MeasureNode(target.RawPtr(), layout);
+                target->RecursivelyClearTag();
+                return layout;
+            }
+        private:
+            struct Memoisation
+            {
+                TermPtr Relocated;
+                Memoisation() = delete;
+                Memoisation(Memoisation const &) = delete;
+                Memoisation(Memoisation &&) = delete;
+                Memoisation &operator = (Memoisation const &) = delete;
+                Memoisation &operator = (Memoisation &&) = delete;
+                void DefaultConstructor()
+                {
+                    Relocated.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Relocated.Finalise();
+                }
+            };
+            typedef Utilities::PodSurrogate<bool> MeasuredTag;
+            bool references;
+            std::vector<std::pair<TermPtr, TermPtr>> copiedReferences;
+            Utilities::RefCountMemPool<Term>::Region region;
+            /* Kept until the tags are cleared, since the caller may
+             * drop them while relocating the next term. */
+            std::vector<TermPtr> originals;
+            TermPtr &Remember(TermPtr const &original)
+            {
+                originals.push_back(original);
+                return original->Tag.NewInstance<Memoisation>()->Relocated;
+            }
+            static void MeasureNode(Term *target, Layout &layout)
+            {
+                target = Term::SkipIndirections(target);
+                if ((bool)target->Tag)
+                {
+                    return;
+                }
+                target->Tag.NewInstance<MeasuredTag>();
+                ++layout.Nodes;
+                switch (target->Kind)
+                {
+                    case Term::AbstractionTerm:
+                        MeasureLink(target, target->AsAbstraction.Result.RawPtr(), layout);
+                        break;
+                    case Term::ApplicationTerm:
+                        MeasureLink(target, target->AsApplication.Function.RawPtr(), layout);
+                        MeasureLink(target, target->AsApplication.Replaced.RawPtr(), layout);
+                        break;
+                }
+            }
+            /* Links to variables are not counted, as all the
+             * occurrences of a variable share one node. */
+            static void MeasureLink(Term const *parent, Term *child, Layout &layout)
+            {
+                static constexpr ptrdiff_t Page = 4096;
+                child = Term::SkipIndirections(child);
+                if (child->Kind != Term::BoundVariableTerm)
+                {
+                    auto const distance = (char const *)child - (char const *)parent;
+                    ++layout.Links;
+                    if (distance > Page || distance < -Page)
                     {
-                        clonedAbstraction = nullptr;
+                        ++layout.FarLinks;
                     }
                 }
-                return target->Tag.RawPtrUnsafe<Memoisation>()->Cloned;
+                MeasureNode(child, layout);
             }
-            TermPtr VisitApplicationTerm(TermPtr const &target)
+            TermPtr VisitInvalidTerm(TermPtr const &)
+            {
+                return nullptr;
+            }
+            TermPtr VisitInternalErrorTerm(TermPtr const &)
+            {
+                return nullptr;
+            }
+            TermPtr VisitBoundVariableTerm(TermPtr const &target)
+            {
+                /* Copied with the binder, if it is relocated. */
+                return (bool)target->Tag
+                    ? target->Tag.RawPtrUnsafe<Memoisation>()->Relocated
+                    : target;
+            }
+            TermPtr VisitNativeTerm(TermPtr const &target)
             {
                 if (!(bool)target->Tag)
                 {
-                    auto clonedFunc = VisitTerm(target->AsApplication.Function);
-                    auto clonedRplc = (bool)clonedFunc
-                        ? VisitTerm(target->AsApplication.Replaced)
-                        : nullptr;
-                    auto memoised = target->Tag.NewInstance<Memoisation>();
-                    if ((bool)clonedRplc)
-                    {
-                        memoised->Cloned.NewInstance()
-                            ->ApplicationConstructor(
-                                std::move(clonedFunc), std::move(clonedRplc)
-                            );
-                    }
+                    auto &relocated = Remember(target);
+                    relocated.NewInstance()->NativeConstructor(
+                        target->AsNative.Operation, target->AsNative.Value);
+                    relocated->Normal = target->Normal;
+                }
+                return target->Tag.RawPtrUnsafe<Memoisation>()->Relocated;
+            }
+            TermPtr VisitReferenceTerm(TermPtr const &target)
+            {
+                if (!references)
+                {
+                    return target;
+                }
+                if ((bool)target->Tag)
+                {
+                    return target->Tag.RawPtrUnsafe<Memoisation>()->Relocated;
+                }
+                /* Memoised first, as the target refers back to it. */
+                TermPtr relocated;
+                relocated.NewInstance()->ReferenceConstructor(target->AsReference.Name);
+                Remember(target) = relocated;
+                copiedReferences.emplace_back(relocated, target);
+                relocated->Tie(VisitTerm(target->AsReference.Target));
+                return relocated;
+            }
+            TermPtr VisitAbstractionTerm(TermPtr const &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return target->Tag.RawPtrUnsafe<Memoisation>()->Relocated;
+                }
+                /* The parent comes before the children. */
+                TermPtr relocated;
+                relocated.NewInstance();
+                Remember(target) = relocated;
+                auto const &variable = target->AsAbstraction.Variable;
+                TermPtr relocatedVariable;
+                if ((bool)variable)
+                {
+                    relocatedVariable.NewInstance()->BoundVariableConstructor(relocated);
+                    relocatedVariable->Normal = variable->Normal;
+                    Remember(variable) = relocatedVariable;
                 }
-                return target->Tag.RawPtrUnsafe<Memoisation>()->Cloned;
+                auto result = VisitTerm(target->AsAbstraction.Result);
+                relocated->AbstractionConstructor(std::move(relocatedVariable), std::move(result));
+                relocated->Normal = target->Normal;
+                return relocated;
+            }
+            TermPtr VisitApplicationTerm(TermPtr const &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return target->Tag.RawPtrUnsafe<Memoisation>()->Relocated;
+                }
+                TermPtr relocated;
+                relocated.NewInstance();
+                Remember(target) = relocated;
+                auto func = VisitTerm(target->AsApplication.Function);
+                auto rplc = VisitTerm(target->AsApplication.Replaced);
+                relocated->ApplicationConstructor(std::move(func), std::move(rplc));
+                relocated->Normal = target->Normal;
+                return relocated;
             }
         };
 
-        /* Perform one step of beta reduction
-         * in normal order with call-by-need. */
-        struct BetaReduction : Term::Visitor<BetaReduction, void (TermPtr &)>
+        /* Performs all the eta-conversions in one pass. Each node
+         * is visited once, and the body of an abstraction is known
+         * not to use the bound variable elsewhere by counting the
+         * references to the variable, which are collected bottom-up
+         * while the body is visited. If isolated, the conversions
+         * are only recorded during the visit, and done afterwards,
+         * innermost first, with CopyOnWrite. */
+        struct EtaConversion : Term::Visitor<EtaConversion, void (TermPtr &)>
         {
-            friend struct Term::Visitor<BetaReduction, void (TermPtr &)>;
-            static bool Perform(TermPtr &target)
+            friend struct Term::Visitor<EtaConversion, void (TermPtr &)>;
+            static bool Perform(TermPtr &target, bool isolated = false)
             {
-                BetaReduction worker;
-                worker.VisitTerm(target);
-                return worker.replacing;
+                Utilities::RefCountMemPool<Memoisation>::Region region;
+                TermPtr surrogate = target;
+                EtaConversion instance(isolated);
+                instance.VisitTerm(target);
+                surrogate->RecursivelyClearTag();
+                /* The root is shared only if referenced elsewhere. */
+                surrogate = nullptr;
+                /* Converted abstractions are no longer reachable
+                 * from the term, but might be referenced elsewhere. */
+                for (auto const &converted : instance.converted)
+                {
+                    converted->RecursivelyClearTag();
+                }
+                /* An abstraction met again is replaced by the result
+                 * of its first conversion. */
+                std::map<Term const *, TermPtr> results;
+                for (auto const &site : instance.sites)
+                {
+                    auto &slot = CopyOnWrite::Unshare(target, site.first);
+                    auto &result = results[site.second.RawPtr()];
+                    if (!(bool)result)
+                    {
+                        result = Term::Expose(slot->AsAbstraction.Result)->AsApplication.Function;
+                    }
+                    slot = result;
+                }
+                return !instance.converted.empty();
             }
         private:
-            BetaReduction() : replacing(false) { }
-            BetaReduction(BetaReduction const &) = default;
-            BetaReduction(BetaReduction &&) = default;
-            BetaReduction &operator = (BetaReduction const &) = default;
-            BetaReduction &operator = (BetaReduction &&) = default;
-            ~BetaReduction() = default;
-            TermPtr replacer, replacee;
-            bool replacing;
+            struct Memoisation
+            {
+                /* For abstractions, the number of references
+                 * to the bound variable found so far. */
+                size_t Occurrences;
+                /* For abstractions, the result of eta-conversion. */
+                TermPtr Converted;
+                Memoisation() = delete;
+                Memoisation(Memoisation const &) = delete;
+                Memoisation(Memoisation &&) = delete;
+                Memoisation &operator = (Memoisation const &) = delete;
+                Memoisation &operator = (Memoisation &&) = delete;
+                void DefaultConstructor()
+                {
+                    Occurrences = 0;
+                    Converted.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Converted.Finalise();
+                }
+            };
+            EtaConversion(bool isolated)
+                : isolated(isolated)
+            { }
+            EtaConversion(EtaConversion const &) = default;
+            EtaConversion(EtaConversion &&) = default;
+            EtaConversion &operator = (EtaConversion const &) = default;
+            EtaConversion &operator = (EtaConversion &&) = default;
+            ~EtaConversion() = default;
+            bool isolated;
+            std::vector<TermPtr> converted;
+            /* In isolation, the path to the visited node, and the
+             * paths to the abstractions to convert. */
+            std::vector<ChildKind> path;
+            std::vector<std::pair<std::vector<ChildKind>, TermPtr>> sites;
+            /* What child stands for after the conversions so far,
+             * which are not done in place in isolation. */
+            static TermPtr const &Converted(TermPtr const &child)
+            {
+                if (child->Kind == Term::AbstractionTerm && child->Tag.Is<Memoisation>())
+                {
+                    auto const &memoised = child->Tag.RawPtrUnsafe<Memoisation>()->Converted;
+                    if ((bool)memoised)
+                    {
+                        return memoised;
+                    }
+                }
+                return child;
+            }
+            void VisitChild(TermPtr &child, ChildKind kind)
+            {
+                if (isolated)
+                {
+                    path.push_back(kind);
+                }
+                VisitTerm(child);
+                if (isolated)
+                {
+                    path.pop_back();
+                }
+            }
+            void Convert(TermPtr &target, TermPtr const &func)
+            {
+                if (isolated)
+                {
+                    sites.emplace_back(path, target);
+                }
+                else
+                {
+                    target = func;
+                }
+            }
+            /* Records a reference from a visited node to child. */
+            static void CountReference(TermPtr const &target, size_t delta = 1)
+            {
+                auto const &child = Converted(target);
+                if (child->Kind != Term::BoundVariableTerm)
+                {
+                    return;
+                }
+                auto const &boundBy = child->AsBoundVariable.BoundBy;
+                /* The binder is not visited if the term is open. */
+                if (boundBy->Tag.Is<Memoisation>())
+                {
+                    boundBy->Tag.RawPtrUnsafe<Memoisation>()->Occurrences += delta;
+                }
+            }
             void VisitInvalidTerm(TermPtr &)
             {
             }
@@ -230,37 +627,2658 @@ namespace LambdaCalculus
             void VisitBoundVariableTerm(TermPtr &)
             {
             }
-            void VisitAbstractionTerm(TermPtr &target)
+            void VisitNativeTerm(TermPtr &)
             {
-                VisitTerm(target->AsAbstraction.Result);
             }
-            void VisitApplicationTerm(TermPtr &target)
+            void VisitReferenceTerm(TermPtr &)
             {
-                auto &func = target->AsApplication.Function;
-                auto &rplc = target->AsApplication.Replaced;
-                if (replacing)
+            }
+            void VisitAbstractionTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
                 {
-                    if (target == replacee)
+                    auto const &memoised = target->Tag.RawPtrUnsafe<Memoisation>()->Converted;
+                    if ((bool)memoised)
                     {
-                        target = replacer;
-                        return;
+                        Convert(target, memoised);
                     }
-                    VisitTerm(func);
-                    VisitTerm(rplc);
                     return;
                 }
-                if (func->Kind == Term::AbstractionTerm)
+                auto memoised = target->Tag.NewInstance<Memoisation>();
+                VisitChild(target->AsAbstraction.Result, CopyOnWrite::Result);
+                auto const &body = Converted(target->AsAbstraction.Result);
+                CountReference(body);
+                if (body->Kind != Term::ApplicationTerm)
+                {
+                    return;
+                }
+                auto const &func = Converted(body->AsApplication.Function);
+                auto const &rplc = body->AsApplication.Replaced;
+                if (rplc->Kind != Term::BoundVariableTerm
+                    || rplc->AsBoundVariable.BoundBy != target
+                    || memoised->Occurrences != 1)
                 {
-                    replacer = DeepCloneAndReplace::Perform(
-                        func->AsAbstraction.Result,
-                        func, rplc);
-                    replacee = target;
-                    replacing = true;
-                    target = replacer;
                     return;
                 }
-                VisitTerm(func);
-                VisitTerm(rplc);
+                /* The reference from the body to func disappears,
+                 * and the one from the parent is counted later. */
+                CountReference(func, (size_t)-1);
+                memoised->Converted = func;
+                converted.push_back(target);
+                Convert(target, func);
+            }
+            void VisitApplicationTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return;
+                }
+                target->Tag.NewInstance<Memoisation>();
+                auto &func = target->AsApplication.Function;
+                auto &rplc = target->AsApplication.Replaced;
+                VisitChild(func, CopyOnWrite::Function);
+                CountReference(func);
+                VisitChild(rplc, CopyOnWrite::Replaced);
+                CountReference(rplc);
+            }
+        };
+
+        typedef unsigned OpcodeKind;
+
+        /* A compiled instantiation of the body of an abstraction.
+         * Instead of walking the body with memoisation on every
+         * contraction, the body is compiled once into a straight-line
+         * sequence of instructions that builds the copy, each storing
+         * its result in the slot of its own index. Subterms that
+         * DeepCloneAndReplace would share are kept as constants, so
+         * the free variables of the body bound outside it become
+         * parameters of the template taken from the environment it
+         * was compiled in, as in lambda lifting. The template is
+         * kept in AsAbstraction.Compiled. */
+        struct InstantiationTemplate
+        {
+            /* Slot := the replaced term. */
+            static constexpr OpcodeKind PushArgument = 0;
+            /* Slot := Shared. */
+            static constexpr OpcodeKind PushShared = 1;
+            /* Slot := a new abstraction, closed later. */
+            static constexpr OpcodeKind NewBinder = 2;
+            /* Slot := a new variable bound by slot First. */
+            static constexpr OpcodeKind NewVariable = 3;
+            /* Slot := application of slot First to slot Second. */
+            static constexpr OpcodeKind NewApplication = 4;
+            /* Completes slot First with variable slot Second
+             * (or none) and result slot Third. */
+            static constexpr OpcodeKind CloseAbstraction = 5;
+            static constexpr size_t NoSlot = (size_t)-1;
+
+            struct Instruction
+            {
+                OpcodeKind Opcode;
+                size_t First, Second, Third;
+                TermPtr Shared;
+                /* Whether this is the last instruction to use the slot
+                 * of the operand, so it takes the term over instead of
+                 * sharing it. Set after the code is compiled. */
+                bool MoveFirst, MoveSecond, MoveThird;
+            };
+
+            InstantiationTemplate() = delete;
+            InstantiationTemplate(InstantiationTemplate const &) = delete;
+            InstantiationTemplate(InstantiationTemplate &&) = delete;
+            InstantiationTemplate &operator = (InstantiationTemplate const &) = delete;
+            InstantiationTemplate &operator = (InstantiationTemplate &&) = delete;
+            void DefaultConstructor()
+            {
+                Code = nullptr;
+                Length = 0;
+                Result = NoSlot;
+            }
+            void Finalise()
+            {
+                delete [] Code;
+            }
+
+            Instruction *Code;
+            size_t Length;
+            size_t Result;
+
+            /* Same as DeepCloneAndReplace::Perform on the body of
+             * abstraction. The template is compiled on first use. */
+            static TermPtr Instantiate(TermPtr const &abstraction, TermPtr const &replaced)
+            {
+                auto &compiled = abstraction->AsAbstraction.Compiled;
+                if (!compiled.Is<InstantiationTemplate>())
+                {
+                    Compiler::Perform(abstraction, *compiled.NewInstance<InstantiationTemplate>());
+                }
+                return compiled.RawPtrUnsafe<InstantiationTemplate>()->Run(replaced);
+            }
+
+            TermPtr Run(TermPtr const &replaced) const
+            {
+                std::vector<TermPtr> slots(Length);
+                for (size_t i = 0; i != Length; ++i)
+                {
+                    auto const &instruction = Code[i];
+                    switch (instruction.Opcode)
+                    {
+                        case PushArgument:
+                            slots[i] = replaced;
+                            break;
+                        case PushShared:
+                            slots[i] = instruction.Shared;
+                            break;
+                        case NewBinder:
+                            slots[i].NewInstance();
+                            break;
+                        case NewVariable:
+                            slots[i].NewInstance()->BoundVariableConstructor(slots[instruction.First]);
+                            break;
+                        /* Of two operands in the same slot, only the
+                         * later one moves, so they are taken in order. */
+                        case NewApplication:
+                        {
+                            auto func = Take(slots, instruction.First, instruction.MoveFirst);
+                            auto rplc = Take(slots, instruction.Second, instruction.MoveSecond);
+                            slots[i].NewInstance()->ApplicationConstructor(
+                                std::move(func), std::move(rplc)
+                            );
+                            break;
+                        }
+                        case CloseAbstraction:
+                        {
+                            auto variable = Take(slots, instruction.Second, instruction.MoveSecond);
+                            auto result = Take(slots, instruction.Third, instruction.MoveThird);
+                            slots[instruction.First]->AbstractionConstructor(
+                                std::move(variable), std::move(result)
+                            );
+                            break;
+                        }
+                    }
+                }
+                return std::move(slots[Result]);
+            }
+
+        private:
+            static TermPtr Take(std::vector<TermPtr> &slots, size_t slot, bool move)
+            {
+                if (slot == NoSlot)
+                {
+                    return nullptr;
+                }
+                if (move)
+                {
+                    return std::move(slots[slot]);
+                }
+                return slots[slot];
+            }
+            /* Marks the last use of every slot, going backwards. The
+             * result is used after the code, and the binders used
+             * by variables are never moved. */
+            void MarkLastUses()
+            {
+                std::vector<bool> used(Length, false);
+                if (Result != NoSlot)
+                {
+                    used[Result] = true;
+                }
+                auto const use = [&used](size_t slot)
+                {
+                    if (slot == NoSlot || used[slot])
+                    {
+                        return false;
+                    }
+                    used[slot] = true;
+                    return true;
+                };
+                for (size_t i = Length; i-- != 0; )
+                {
+                    auto &instruction = Code[i];
+                    switch (instruction.Opcode)
+                    {
+                        case NewVariable:
+                            used[instruction.First] = true;
+                            break;
+                        case NewApplication:
+                            instruction.MoveSecond = use(instruction.Second);
+                            instruction.MoveFirst = use(instruction.First);
+                            break;
+                        case CloseAbstraction:
+                            instruction.MoveThird = use(instruction.Third);
+                            instruction.MoveSecond = use(instruction.Second);
+                            break;
+                    }
+                }
+            }
+
+            /* Mirrors DeepCloneAndReplace, emitting instructions
+             * instead of building terms. */
+            struct Compiler : Term::Visitor<Compiler, size_t (TermPtr const &)>
+            {
+                friend struct Term::Visitor<Compiler, size_t (TermPtr const &)>;
+                static void Perform(TermPtr const &abstraction, InstantiationTemplate &result)
+                {
+                    Utilities::RefCountMemPool<Memoisation>::Region region;
+                    Compiler instance(abstraction);
+                    auto const &body = abstraction->AsAbstraction.Result;
+                    result.Result = instance.VisitTerm(body);
+                    body->RecursivelyClearTag();
+                    result.Length = instance.code.size();
+                    result.Code = new Instruction[result.Length];
+                    for (size_t i = 0; i != result.Length; ++i)
+                    {
+                        result.Code[i] = std::move(instance.code[i]);
+                    }
+                    result.MarkLastUses();
+                }
+            private:
+                struct Memoisation
+                {
+                    size_t Slot;
+                    Memoisation() = delete;
+                    Memoisation(Memoisation const &) = delete;
+                    Memoisation(Memoisation &&) = delete;
+                    Memoisation &operator = (Memoisation const &) = delete;
+                    Memoisation &operator = (Memoisation &&) = delete;
+                    void DefaultConstructor()
+                    {
+                        Slot = NoSlot;
+                    }
+                    void Finalise()
+                    {
+                    }
+                };
+                Compiler(TermPtr const &abstraction)
+                    : abstraction(abstraction)
+                { }
+                Compiler(Compiler &&) = default;
+                Compiler(Compiler const &) = default;
+                Compiler &operator = (Compiler &&) = delete;
+                Compiler &operator = (Compiler const &) = delete;
+                ~Compiler() = default;
+                TermPtr const &abstraction;
+                std::vector<Instruction> code;
+                size_t Emit(OpcodeKind opcode, size_t first = NoSlot,
+                    size_t second = NoSlot, size_t third = NoSlot,
+                    TermPtr shared = nullptr)
+                {
+                    code.push_back({ opcode, first, second, third, std::move(shared), false, false, false });
+                    return code.size() - 1;
+                }
+                size_t Memoise(TermPtr const &target, size_t slot)
+                {
+                    target->Tag.NewInstance<Memoisation>()->Slot = slot;
+                    return slot;
+                }
+                /* Returns NoSlot if target is not visited yet. */
+                static size_t Memoised(TermPtr const &target)
+                {
+                    return target->Tag.Is<Memoisation>()
+                        ? target->Tag.RawPtrUnsafe<Memoisation>()->Slot
+                        : NoSlot;
+                }
+                size_t VisitInvalidTerm(TermPtr const &)
+                {
+                    return NoSlot;
+                }
+                size_t VisitInternalErrorTerm(TermPtr const &)
+                {
+                    return NoSlot;
+                }
+                size_t VisitBoundVariableTerm(TermPtr const &target)
+                {
+                    auto slot = Memoised(target);
+                    if (slot != NoSlot)
+                    {
+                        return slot;
+                    }
+                    auto const &boundBy = target->AsBoundVariable.BoundBy;
+                    if (boundBy == abstraction)
+                    {
+                        return Memoise(target, Emit(PushArgument));
+                    }
+                    if (IsUnaffected<Memoisation>(target, abstraction.RawPtr()))
+                    {
+                        return Memoise(target, Emit(PushShared, NoSlot, NoSlot, NoSlot, target));
+                    }
+                    return Memoise(target, Emit(NewVariable, Memoised(boundBy)));
+                }
+                size_t VisitNativeTerm(TermPtr const &target)
+                {
+                    return Emit(PushShared, NoSlot, NoSlot, NoSlot, target);
+                }
+                size_t VisitReferenceTerm(TermPtr const &target)
+                {
+                    return Emit(PushShared, NoSlot, NoSlot, NoSlot, target);
+                }
+                size_t VisitAbstractionTerm(TermPtr const &target)
+                {
+                    auto slot = Memoised(target);
+                    if (slot != NoSlot)
+                    {
+                        return slot;
+                    }
+                    if (IsUnaffected<Memoisation>(target, abstraction.RawPtr()))
+                    {
+                        return Memoise(target, Emit(PushShared, NoSlot, NoSlot, NoSlot, target));
+                    }
+                    auto const binder = Memoise(target, Emit(NewBinder));
+                    auto const result = VisitTerm(target->AsAbstraction.Result);
+                    if (result == NoSlot)
+                    {
+                        return NoSlot;
+                    }
+                    auto const &variable = target->AsAbstraction.Variable;
+                    Emit(CloseAbstraction, binder,
+                        (bool)variable ? Memoised(variable) : NoSlot, result);
+                    return binder;
+                }
+                size_t VisitApplicationTerm(TermPtr const &target)
+                {
+                    auto slot = Memoised(target);
+                    if (slot != NoSlot)
+                    {
+                        return slot;
+                    }
+                    if (IsUnaffected<Memoisation>(target, abstraction.RawPtr()))
+                    {
+                        return Memoise(target, Emit(PushShared, NoSlot, NoSlot, NoSlot, target));
+                    }
+                    auto const func = VisitTerm(target->AsApplication.Function);
+                    auto const rplc = func == NoSlot ? NoSlot : VisitTerm(target->AsApplication.Replaced);
+                    if (rplc == NoSlot)
+                    {
+                        return NoSlot;
+                    }
+                    return Memoise(target, Emit(NewApplication, func, rplc));
+                }
+            };
+        };
+
+        /* Decides whether two terms are the same up to renaming of
+         * bound variables. Shared subterms are compared once for
+         * each path, so this is meant for small terms. */
+        struct AlphaEquivalence
+        {
+            AlphaEquivalence() = delete;
+            static bool Check(TermPtr const &lhs, TermPtr const &rhs)
+            {
+                std::vector<Term const *> lhsBinders, rhsBinders;
+                return Compare(lhs.RawPtr(), rhs.RawPtr(), lhsBinders, rhsBinders);
+            }
+        private:
+            /* Returns the de Bruijn index of binder, or 0 if free. */
+            static size_t IndexOf(std::vector<Term const *> const &binders, Term const *binder)
+            {
+                for (size_t i = binders.size(); i != 0; --i)
+                {
+                    if (binders[i - 1] == binder)
+                    {
+                        return binders.size() - i + 1;
+                    }
+                }
+                return 0;
+            }
+            static bool Compare(Term const *lhs, Term const *rhs,
+                std::vector<Term const *> &lhsBinders,
+                std::vector<Term const *> &rhsBinders)
+            {
+                lhs = Term::Expose(lhs);
+                rhs = Term::Expose(rhs);
+                if (lhs->Kind != rhs->Kind)
+                {
+                    return false;
+                }
+                switch (lhs->Kind)
+                {
+                    case Term::BoundVariableTerm:
+                    {
+                        auto const lhsBinder = lhs->AsBoundVariable.BoundBy.RawPtr();
+                        auto const rhsBinder = rhs->AsBoundVariable.BoundBy.RawPtr();
+                        auto const index = IndexOf(lhsBinders, lhsBinder);
+                        return index == IndexOf(rhsBinders, rhsBinder)
+                            && (index != 0 || lhsBinder == rhsBinder);
+                    }
+                    case Term::AbstractionTerm:
+                    {
+                        lhsBinders.push_back(lhs);
+                        rhsBinders.push_back(rhs);
+                        bool const result = Compare(
+                            lhs->AsAbstraction.Result.RawPtr(),
+                            rhs->AsAbstraction.Result.RawPtr(),
+                            lhsBinders, rhsBinders);
+                        lhsBinders.pop_back();
+                        rhsBinders.pop_back();
+                        return result;
+                    }
+                    case Term::ApplicationTerm:
+                        return Compare(
+                                lhs->AsApplication.Function.RawPtr(),
+                                rhs->AsApplication.Function.RawPtr(),
+                                lhsBinders, rhsBinders)
+                            && Compare(
+                                lhs->AsApplication.Replaced.RawPtr(),
+                                rhs->AsApplication.Replaced.RawPtr(),
+                                lhsBinders, rhsBinders);
+                    case Term::NativeTerm:
+                        return lhs->AsNative.Operation == rhs->AsNative.Operation
+                            && lhs->AsNative.Value == rhs->AsNative.Value;
+                    case Term::ReferenceTerm:
+                        return lhs->AsReference.Target == rhs->AsReference.Target;
+                    default:
+                        return false;
+                }
+            }
+        };
+
+        /* Delta rules of the native terms. */
+        struct NativeArithmetic
+        {
+            NativeArithmetic() = delete;
+            static size_t Arity(NativeOperation operation)
+            {
+                switch (operation)
+                {
+                    case Term::NativeSuccessor:
+                    case Term::NativePredecessor:
+                    case Term::NativeIsZero:
+                        return 1;
+                    case Term::NativeAddition:
+                    case Term::NativeMultiplication:
+                        return 2;
+                    default:
+                        return 0;
+                }
+            }
+            static TermPtr Numeral(size_t value)
+            {
+                TermPtr result;
+                result.NewInstance()->NativeConstructor(Term::NativeNumeral, value);
+                return result;
+            }
+            /* Recognises ..2(2(...(2 1))) and stores its value. */
+            static bool IsChurchNumeral(TermPtr const &target, size_t &value)
+            {
+                auto const outer = Term::Expose(target.RawPtr());
+                if (outer->Kind != Term::AbstractionTerm)
+                {
+                    return false;
+                }
+                auto const inner = Term::Expose(outer->AsAbstraction.Result.RawPtr());
+                if (inner->Kind != Term::AbstractionTerm)
+                {
+                    return false;
+                }
+                Term const *body = Term::Expose(inner->AsAbstraction.Result.RawPtr());
+                size_t count = 0;
+                for (; body->Kind == Term::ApplicationTerm; ++count)
+                {
+                    auto const func = Term::Expose(body->AsApplication.Function.RawPtr());
+                    if (func->Kind != Term::BoundVariableTerm
+                        || func->AsBoundVariable.BoundBy != outer)
+                    {
+                        return false;
+                    }
+                    body = Term::Expose(body->AsApplication.Replaced.RawPtr());
+                }
+                if (body->Kind != Term::BoundVariableTerm
+                    || body->AsBoundVariable.BoundBy != inner)
+                {
+                    return false;
+                }
+                value = count;
+                return true;
+            }
+            /* Returns the native combinator alpha-equivalent to target,
+             * or nullptr if there is none. */
+            static TermPtr RecogniseOperation(TermPtr const &target)
+            {
+                for (NativeOperation operation = Term::NativeSuccessor;
+                    operation <= Term::NativeMultiplication;
+                    ++operation)
+                {
+                    if (AlphaEquivalence::Check(target,
+                        DeBruijnIndex::Parser::ChurchEncoding::Operation(operation)))
+                    {
+                        TermPtr result;
+                        result.NewInstance()->NativeConstructor(operation);
+                        return result;
+                    }
+                }
+                return nullptr;
+            }
+            /* Computes the operation applied to numerals. Returns
+             * nullptr if the result does not fit in size_t. */
+            static TermPtr Apply(NativeOperation operation, size_t const *values)
+            {
+                switch (operation)
+                {
+                    case Term::NativeSuccessor:
+                        return values[0] + 1 == 0
+                            ? nullptr
+                            : Numeral(values[0] + 1);
+                    case Term::NativePredecessor:
+                        return Numeral(values[0] == 0 ? 0 : values[0] - 1);
+                    case Term::NativeIsZero:
+                        return DeBruijnIndex::Parser::ChurchEncoding::Boolean(values[0] == 0);
+                    case Term::NativeAddition:
+                        return values[0] + values[1] < values[0]
+                            ? nullptr
+                            : Numeral(values[0] + values[1]);
+                    case Term::NativeMultiplication:
+                        return values[0] != 0 && values[0] * values[1] / values[0] != values[1]
+                            ? nullptr
+                            : Numeral(values[0] * values[1]);
+                    default:
+                        return nullptr;
+                }
+            }
+            /* The Church form of a native term. */
+            static TermPtr Materialised(TermPtr const &target)
+            {
+                return target->AsNative.Operation == Term::NativeNumeral
+                    ? DeBruijnIndex::Parser::ChurchEncoding::Numeral(target->AsNative.Value)
+                    : DeBruijnIndex::Parser::ChurchEncoding::Operation(target->AsNative.Operation);
+            }
+        };
+
+        /* Replaces Church numerals in normal form and subterms
+         * alpha-equivalent to the Church combinators of successor,
+         * predecessor, zero test, addition and multiplication by
+         * native terms. */
+        struct RecogniseNativeTerms : Term::Visitor<RecogniseNativeTerms, void (TermPtr &)>
+        {
+            friend struct Term::Visitor<RecogniseNativeTerms, void (TermPtr &)>;
+            static void Perform(TermPtr &target)
+            {
+                TermPtr surrogate = target;
+                RecogniseNativeTerms instance;
+                instance.VisitTerm(target);
+                surrogate->RecursivelyClearTag();
+                for (auto const &replaced : instance.replaced)
+                {
+                    replaced->RecursivelyClearTag();
+                }
+            }
+        private:
+            struct Memoisation
+            {
+                TermPtr Replacement;
+                Memoisation() = delete;
+                Memoisation(Memoisation const &) = delete;
+                Memoisation(Memoisation &&) = delete;
+                Memoisation &operator = (Memoisation const &) = delete;
+                Memoisation &operator = (Memoisation &&) = delete;
+                void DefaultConstructor()
+                {
+                    Replacement.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Replacement.Finalise();
+                }
+            };
+            RecogniseNativeTerms() = default;
+            std::vector<TermPtr> replaced;
+            void VisitInvalidTerm(TermPtr &)
+            {
+            }
+            void VisitInternalErrorTerm(TermPtr &)
+            {
+            }
+            void VisitBoundVariableTerm(TermPtr &)
+            {
+            }
+            void VisitNativeTerm(TermPtr &)
+            {
+            }
+            void VisitReferenceTerm(TermPtr &)
+            {
+            }
+            void VisitAbstractionTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    auto const &memoised = target->Tag.RawPtrUnsafe<Memoisation>()->Replacement;
+                    if ((bool)memoised)
+                    {
+                        target = memoised;
+                    }
+                    return;
+                }
+                auto &memoised = target->Tag.NewInstance<Memoisation>()->Replacement;
+                size_t value;
+                if (NativeArithmetic::IsChurchNumeral(target, value))
+                {
+                    memoised = NativeArithmetic::Numeral(value);
+                }
+                else
+                {
+                    memoised = NativeArithmetic::RecogniseOperation(target);
+                }
+                if ((bool)memoised)
+                {
+                    replaced.push_back(target);
+                    target = memoised;
+                    return;
+                }
+                VisitTerm(target->AsAbstraction.Result);
+            }
+            void VisitApplicationTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return;
+                }
+                target->Tag.NewInstance<Memoisation>();
+                VisitTerm(target->AsApplication.Function);
+                VisitTerm(target->AsApplication.Replaced);
+            }
+        };
+
+        /* Replaces native terms by their Church forms. A numeral
+         * whose Church form would take the live nodes over
+         * maxLiveNodes (0 for unlimited) is left native. */
+        struct MaterialiseNativeTerms : Term::Visitor<MaterialiseNativeTerms, void (TermPtr &)>
+        {
+            friend struct Term::Visitor<MaterialiseNativeTerms, void (TermPtr &)>;
+            /* Returns false if a numeral is left native. Combinators
+             * tells whether any native combinator (as opposed to
+             * numeral) is replaced, which might create beta-redexes,
+             * and deep whether a numeral is left native because it
+             * is deeper than the largest literal. */
+            static bool Perform(TermPtr &target, size_t maxLiveNodes, bool &combinators,
+                bool &deep, std::vector<std::pair<TermPtr, TermPtr>> const &references = {})
+            {
+                TermPtr surrogate = target;
+                MaterialiseNativeTerms instance(maxLiveNodes, references);
+                instance.VisitTerm(target);
+                surrogate->RecursivelyClearTag();
+                for (auto const &replaced : instance.replaced)
+                {
+                    replaced->RecursivelyClearTag();
+                }
+                combinators = instance.combinators;
+                deep = instance.deep;
+                return instance.complete;
+            }
+        private:
+            struct Memoisation
+            {
+                TermPtr Replacement;
+                Memoisation() = delete;
+                Memoisation(Memoisation const &) = delete;
+                Memoisation(Memoisation &&) = delete;
+                Memoisation &operator = (Memoisation const &) = delete;
+                Memoisation &operator = (Memoisation &&) = delete;
+                void DefaultConstructor()
+                {
+                    Replacement.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Replacement.Finalise();
+                }
+            };
+            MaterialiseNativeTerms(size_t maxLiveNodes,
+                std::vector<std::pair<TermPtr, TermPtr>> const &references)
+                : maxLiveNodes(maxLiveNodes), references(references),
+                combinators(false), deep(false), complete(true)
+            { }
+            std::vector<TermPtr> replaced;
+            size_t maxLiveNodes;
+            /* Copies of references, each with the original it is
+             * put back to (Compaction::References). */
+            std::vector<std::pair<TermPtr, TermPtr>> const &references;
+            bool combinators;
+            bool deep;
+            bool complete;
+            /* ..2(2(...(2 1))) takes a node per application, and
+             * two per abstraction with its variable. */
+            bool Affordable(size_t value) const
+            {
+                auto const live = Utilities::RefCountMemPool<Term>::Default.LiveCount();
+                return maxLiveNodes == 0
+                    || (live <= maxLiveNodes && value <= maxLiveNodes - live
+                        && maxLiveNodes - live - value >= 4);
+            }
+            void VisitInvalidTerm(TermPtr &)
+            {
+            }
+            void VisitInternalErrorTerm(TermPtr &)
+            {
+            }
+            void VisitBoundVariableTerm(TermPtr &)
+            {
+            }
+            void VisitNativeTerm(TermPtr &target)
+            {
+                if (!(bool)target->Tag)
+                {
+                    /* Numerals deeper than the largest literal are
+                     * left native, so that the visitors never meet
+                     * them. */
+                    if (target->AsNative.Operation == Term::NativeNumeral
+                        && target->AsNative.Value > DeBruijnIndex::Lexer::Token::MaxNumeral)
+                    {
+                        complete = false;
+                        deep = true;
+                        return;
+                    }
+                    if (target->AsNative.Operation == Term::NativeNumeral
+                        && !Affordable(target->AsNative.Value))
+                    {
+                        complete = false;
+                        return;
+                    }
+                    target->Tag.NewInstance<Memoisation>()->Replacement
+                        = NativeArithmetic::Materialised(target);
+                    replaced.push_back(target);
+                    combinators = combinators
+                        || target->AsNative.Operation != Term::NativeNumeral;
+                }
+                target = target->Tag.RawPtrUnsafe<Memoisation>()->Replacement;
+            }
+            void VisitReferenceTerm(TermPtr &target)
+            {
+                for (auto const &reference : references)
+                {
+                    if (reference.first == target)
+                    {
+                        target = reference.second;
+                        return;
+                    }
+                }
+            }
+            /* Converting a combinator back might create a redex,
+             * so the normal form flags are cleared. */
+            void VisitAbstractionTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return;
+                }
+                target->Tag.NewInstance<Memoisation>();
+                target->Normal = false;
+                VisitTerm(target->AsAbstraction.Result);
+            }
+            void VisitApplicationTerm(TermPtr &target)
+            {
+                if ((bool)target->Tag)
+                {
+                    return;
+                }
+                target->Tag.NewInstance<Memoisation>();
+                target->Normal = false;
+                VisitTerm(target->AsApplication.Function);
+                VisitTerm(target->AsApplication.Replaced);
+            }
+        };
+
+        typedef unsigned StrategyKind;
+
+        /* Evaluation strategies understood by BetaReduction.
+         * - NormalOrder contracts the leftmost outermost redex,
+         *   reducing under abstractions (full normalisation).
+         * - ApplicativeOrder contracts the leftmost innermost redex,
+         *   reducing under abstractions (full normalisation).
+         * - HeadNormalForm contracts the head redex only.
+         * - WeakHeadNormalForm contracts the head redex, and does
+         *   not reduce under abstractions.
+         * - CallByValue reduces the function and the argument to
+         *   weak head normal forms before contracting, and does
+         *   not reduce under abstractions.
+         */
+        struct Strategy
+        {
+            static constexpr StrategyKind NormalOrder = 0;
+            static constexpr StrategyKind ApplicativeOrder = 1;
+            static constexpr StrategyKind HeadNormalForm = 2;
+            static constexpr StrategyKind WeakHeadNormalForm = 3;
+            static constexpr StrategyKind CallByValue = 4;
+
+            static bool IsFull(StrategyKind strategy)
+            {
+                return strategy == NormalOrder
+                    || strategy == ApplicativeOrder;
+            }
+            static bool IsWeak(StrategyKind strategy)
+            {
+                return strategy == WeakHeadNormalForm
+                    || strategy == CallByValue;
+            }
+            static bool IsInnermost(StrategyKind strategy)
+            {
+                return strategy == ApplicativeOrder
+                    || strategy == CallByValue;
+            }
+            static char const *Name(StrategyKind strategy)
+            {
+                switch (strategy)
+                {
+                    case NormalOrder:
+                        return "normal";
+                    case ApplicativeOrder:
+                        return "applicative";
+                    case HeadNormalForm:
+                        return "hnf";
+                    case WeakHeadNormalForm:
+                        return "whnf";
+                    case CallByValue:
+                        return "cbv";
+                    default:
+                        return nullptr;
+                }
+            }
+            /* Returns false if the name is not recognised. */
+            static bool FromName(char const *name, StrategyKind &strategy)
+            {
+                for (StrategyKind i = NormalOrder; i <= CallByValue; ++i)
+                {
+                    auto candidate = Name(i);
+                    size_t j = 0;
+                    for (; candidate[j] && candidate[j] == name[j]; ++j)
+                        ;
+                    if (!candidate[j] && !name[j])
+                    {
+                        strategy = i;
+                        return true;
+                    }
+                }
+                return false;
+            }
+        };
+
+        typedef unsigned InstantiationKind;
+
+        /* How BetaReduction builds the result of a contraction. */
+        struct Instantiation
+        {
+            /* DeepCloneAndReplace. */
+            static constexpr InstantiationKind Copy = 0;
+            /* InstantiationTemplate. */
+            static constexpr InstantiationKind Compiled = 1;
+            /* A substitution term (Term::SubstitutionTerm), pushed
+             * down only as far as the reduction looks into it. */
+            static constexpr InstantiationKind Explicit = 2;
+        };
+
+        /* Where the last step of BetaReduction rewrote the term: the
+         * path from the root to the parent of the rewritten node, and
+         * the nodes on it. The next step starts its search there, since
+         * everything visited before it in the strategy is known to have
+         * no redex, and only falls back to the root if the subterm has
+         * none either. The cursor is only followed while every node on
+         * the path is still the same, so it is dropped when the term is
+         * rewritten by anything else. */
+        struct RedexCursor
+        {
+            std::vector<ChildKind> Path;
+            std::vector<Term const *> Nodes;
+
+            void Clear()
+            {
+                Path.clear();
+                Nodes.clear();
+            }
+            /* Records the nodes on Path, starting from root. */
+            void Record(TermPtr const &root)
+            {
+                Nodes.clear();
+                TermPtr const *slot = &root;
+                for (auto const child : Path)
+                {
+                    auto const &node = Term::Expose(*slot);
+                    if (!Leads(node, child))
+                    {
+                        Clear();
+                        return;
+                    }
+                    Nodes.push_back(node.RawPtr());
+                    slot = &CopyOnWrite::Child(node, child);
+                }
+                Nodes.push_back(Term::Expose(*slot).RawPtr());
+            }
+            /* The slot at the end of Path, or nullptr if the path
+             * is empty or no longer leads through the same nodes. */
+            TermPtr *Follow(TermPtr &root) const
+            {
+                if (Path.empty() || Nodes.size() != Path.size() + 1)
+                {
+                    return nullptr;
+                }
+                TermPtr *slot = &root;
+                for (size_t i = 0; ; ++i)
+                {
+                    auto &node = Term::Expose(*slot);
+                    if (node.RawPtr() != Nodes[i])
+                    {
+                        return nullptr;
+                    }
+                    if (i == Path.size())
+                    {
+                        return &node;
+                    }
+                    if (!Leads(node, Path[i]))
+                    {
+                        return nullptr;
+                    }
+                    slot = &CopyOnWrite::Child(node, Path[i]);
+                }
+            }
+        private:
+            static bool Leads(TermPtr const &node, ChildKind child)
+            {
+                return node->Kind == (child == CopyOnWrite::Result
+                    ? Term::AbstractionTerm : Term::ApplicationTerm);
+            }
+        };
+
+        /* Perform one step of beta reduction
+         * in the specified strategy with call-by-need.
+         * The reduced application is overwritten in place by an
+         * indirection to the result, so every reference to it,
+         * including those from outside the target, is updated.
+         * If isolated, the nodes above it that are shared are copied
+         * instead (CopyOnWrite), and it is only replaced in the copy,
+         * so other terms are left untouched, but so is sharing inside
+         * the target. */
+        struct BetaReduction : Term::Visitor<BetaReduction, void (TermPtr &)>
+        {
+            friend struct Term::Visitor<BetaReduction, void (TermPtr &)>;
+            static bool Perform(TermPtr &target,
+                StrategyKind strategy = Strategy::NormalOrder,
+                InstantiationKind instantiation = Instantiation::Copy,
+                bool isolated = false, RedexCursor *cursor = nullptr)
+            {
+                BetaReduction worker(strategy, instantiation, isolated, target, cursor);
+                if (cursor != nullptr)
+                {
+                    auto const start = cursor->Follow(target);
+                    worker.path = cursor->Path;
+                    cursor->Clear();
+                    if (start != nullptr)
+                    {
+                        worker.VisitTerm(*start);
+                    }
+                }
+                if (!worker.performed)
+                {
+                    worker.path.clear();
+                    worker.VisitTerm(target);
+                }
+                if (cursor != nullptr && worker.performed)
+                {
+                    cursor->Record(target);
+                }
+                return worker.performed;
+            }
+        private:
+            BetaReduction(StrategyKind strategy, InstantiationKind instantiation,
+                bool isolated, TermPtr &root, RedexCursor *cursor)
+                : strategy(strategy), instantiation(instantiation),
+                isolated(isolated), root(&root), cursor(cursor), performed(false)
+            { }
+            BetaReduction(BetaReduction const &) = default;
+            BetaReduction(BetaReduction &&) = default;
+            BetaReduction &operator = (BetaReduction const &) = default;
+            BetaReduction &operator = (BetaReduction &&) = default;
+            ~BetaReduction() = default;
+            StrategyKind strategy;
+            InstantiationKind instantiation;
+            bool isolated;
+            TermPtr *root;
+            RedexCursor *cursor;
+            /* In isolation, or with a cursor, the path to the visited
+             * node. */
+            std::vector<ChildKind> path;
+            bool performed;
+            void VisitChild(TermPtr &child, ChildKind kind)
+            {
+                bool const tracked = isolated || cursor != nullptr;
+                if (tracked)
+                {
+                    path.push_back(kind);
+                }
+                VisitTerm(child);
+                if (tracked)
+                {
+                    path.pop_back();
+                }
+            }
+            /* Called where the visited node, or its child, is
+             * rewritten. */
+            void Performed()
+            {
+                if (cursor != nullptr && !performed && !path.empty())
+                {
+                    cursor->Path.assign(path.begin(), path.end() - 1);
+                }
+                performed = true;
+            }
+            /* The slot through which the visited node, or its child,
+             * is replaced. In isolation, the slot is in a copy if
+             * the node holding it is shared. */
+            TermPtr &Rewritable(TermPtr &target)
+            {
+                return isolated ? CopyOnWrite::Unshare(*root, path) : target;
+            }
+            TermPtr &Rewritable(TermPtr &target, ChildKind child)
+            {
+                if (!isolated)
+                {
+                    return CopyOnWrite::Child(target, child);
+                }
+                path.push_back(child);
+                auto &slot = CopyOnWrite::Unshare(*root, path);
+                path.pop_back();
+                return slot;
+            }
+            void VisitInvalidTerm(TermPtr &)
+            {
+            }
+            void VisitInternalErrorTerm(TermPtr &)
+            {
+            }
+            void VisitBoundVariableTerm(TermPtr &)
+            {
+            }
+            void VisitNativeTerm(TermPtr &)
+            {
+            }
+            void VisitReferenceTerm(TermPtr &)
+            {
+            }
+            void VisitAbstractionTerm(TermPtr &target)
+            {
+                if (target->Normal || Strategy::IsWeak(strategy))
+                {
+                    return;
+                }
+                VisitChild(target->AsAbstraction.Result, CopyOnWrite::Result);
+                MarkNormal(target);
+            }
+            void VisitApplicationTerm(TermPtr &target)
+            {
+                if (target->Normal)
+                {
+                    return;
+                }
+                auto &func = Term::Expose(target->AsApplication.Function);
+                auto &rplc = target->AsApplication.Replaced;
+                if (func->Kind == Term::NativeTerm
+                    && func->AsNative.Operation == Term::NativeNumeral)
+                {
+                    /* Numerals applied as functions are converted back. */
+                    func = NativeArithmetic::Materialised(func);
+                    Performed();
+                    return;
+                }
+                if (func->Kind == Term::ReferenceTerm)
+                {
+                    /* References applied as functions are unfolded.
+                     * Elsewhere they are left as they are, so a
+                     * recursive definition is not unfolded forever.
+                     * The definition is copied, since reducing its
+                     * own nodes in place could unfold a reference
+                     * inside it into itself. */
+                    TermPtr unfolded;
+                    {
+                        Compaction compaction;
+                        unfolded = compaction.Relocate(func->AsReference.Target);
+                    }
+                    Rewritable(target, CopyOnWrite::Function) = std::move(unfolded);
+                    Performed();
+                    return;
+                }
+                if (ReduceNative(target))
+                {
+                    return;
+                }
+                if (Strategy::IsInnermost(strategy))
+                {
+                    VisitChild(func, CopyOnWrite::Function);
+                    if (!performed)
+                    {
+                        VisitChild(rplc, CopyOnWrite::Replaced);
+                    }
+                    if (!performed && func->Kind == Term::AbstractionTerm)
+                    {
+                        Contract(target);
+                    }
+                    MarkNormal(target);
+                    return;
+                }
+                if (func->Kind == Term::AbstractionTerm)
+                {
+                    Contract(target);
+                    return;
+                }
+                VisitChild(func, CopyOnWrite::Function);
+                /* Only normal order looks into the arguments
+                 * of a head normal form. */
+                if (!performed && strategy == Strategy::NormalOrder)
+                {
+                    VisitChild(rplc, CopyOnWrite::Replaced);
+                    MarkNormal(target);
+                }
+            }
+            /* Called after target is fully visited. */
+            void MarkNormal(TermPtr &target)
+            {
+                if (!performed && Strategy::IsFull(strategy))
+                {
+                    target->Normal = true;
+                }
+            }
+            /* Performs one step towards the delta rule if target is
+             * a native combinator applied to exactly as many arguments
+             * as it takes. The arguments are first reduced in normal
+             * order. If one of them has a normal form that is not a
+             * numeral, the combinator is converted back. */
+            bool ReduceNative(TermPtr &target)
+            {
+                static constexpr size_t MaxArity = 2;
+                TermPtr *arguments[MaxArity];
+                size_t count = 0;
+                Term *head = target.RawPtr();
+                for (; head->Kind == Term::ApplicationTerm && count != MaxArity;
+                    head = Term::Expose(head->AsApplication.Function).RawPtr())
+                {
+                    arguments[count++] = &head->AsApplication.Replaced;
+                }
+                if (head->Kind != Term::NativeTerm
+                    || head->AsNative.Operation == Term::NativeNumeral
+                    || NativeArithmetic::Arity(head->AsNative.Operation) != count)
+                {
+                    return false;
+                }
+                size_t values[MaxArity];
+                for (size_t i = count; i-- != 0; )
+                {
+                    auto &argument = Term::Expose(*arguments[i]);
+                    size_t value;
+                    if (NativeArithmetic::IsChurchNumeral(argument, value))
+                    {
+                        argument = NativeArithmetic::Numeral(value);
+                    }
+                    if (argument->Kind == Term::NativeTerm
+                        && argument->AsNative.Operation == Term::NativeNumeral)
+                    {
+                        values[count - 1 - i] = argument->AsNative.Value;
+                        continue;
+                    }
+                    if (!Perform(RewritableArgument(argument, i),
+                        Strategy::NormalOrder, instantiation, isolated))
+                    {
+                        MaterialiseHead(target, count);
+                    }
+                    Performed();
+                    return true;
+                }
+                auto result = NativeArithmetic::Apply(head->AsNative.Operation, values);
+                if (!(bool)result)
+                {
+                    MaterialiseHead(target, count);
+                }
+                else
+                {
+                    Update(Rewritable(target), std::move(result));
+                }
+                Performed();
+                return true;
+            }
+            /* The slot of the index-th last argument of target. */
+            TermPtr &RewritableArgument(TermPtr &argument, size_t index)
+            {
+                if (!isolated)
+                {
+                    return argument;
+                }
+                auto const depth = path.size();
+                path.insert(path.end(), index, (ChildKind)CopyOnWrite::Function);
+                path.push_back((ChildKind)CopyOnWrite::Replaced);
+                auto &slot = CopyOnWrite::Unshare(*root, path);
+                path.resize(depth);
+                return slot;
+            }
+            static void MaterialiseHead(TermPtr &target, size_t count)
+            {
+                TermPtr *head = &target;
+                for (; count != 0; --count)
+                {
+                    head = &Term::Expose((*head)->AsApplication.Function);
+                }
+                *head = NativeArithmetic::Materialised(*head);
+            }
+            void Contract(TermPtr &target)
+            {
+                /* The copy of an abstraction above target copies
+                 * target as well if it uses the variable. */
+                auto &slot = Rewritable(target);
+                auto &func = slot->AsApplication.Function;
+                auto &rplc = slot->AsApplication.Replaced;
+                switch (instantiation)
+                {
+                    case Instantiation::Compiled:
+                        Update(slot, InstantiationTemplate::Instantiate(func, rplc));
+                        break;
+                    case Instantiation::Explicit:
+                        Update(slot, Substitution(func, rplc));
+                        break;
+                    default:
+                        Update(slot, DeepCloneAndReplace::Perform(
+                            func->AsAbstraction.Result,
+                            func, rplc));
+                        break;
+                }
+                Performed();
+            }
+            static TermPtr Substitution(TermPtr const &func, TermPtr const &rplc)
+            {
+                if (!(bool)func->AsAbstraction.Variable)
+                {
+                    return func->AsAbstraction.Result;
+                }
+                TermPtr result;
+                result.NewInstance()->SubstitutionConstructor(
+                    func->AsAbstraction.Result,
+                    Term::Bind(func, rplc, nullptr));
+                return result;
+            }
+            /* Overwrites the reduced term for all its references,
+             * and makes target refer to the result directly. In
+             * isolation, only target refers to the result. */
+            void Update(TermPtr &target, TermPtr result)
+            {
+                if (!isolated)
+                {
+                    target->Overwrite(result);
+                }
+                target = std::move(result);
+            }
+        };
+
+        /* A mark-sweep collector for terms, which replaces their
+         * reference counts when built with LAMBDA_CALCULUS_TRACING_GC.
+         * Terms are marked from the root sources (Term::RootSources)
+         * and from the term being reduced, and the unmarked ones are
+         * swept back to the pool. Collections only happen between
+         * the steps of a ReductionSession, where the reducer holds
+         * no other term, so its stack is not scanned, and wherever
+         * the caller holds no term outside the root sources, such as
+         * between the commands of the playground. The bindings of
+         * substitutions are still reference counted, and are walked
+         * from every substitution that refers to them. */
+        struct TracingCollector
+        {
+            TracingCollector() = delete;
+            /* Collections start once this many terms are live, and
+             * then whenever the live terms double. */
+            static constexpr size_t MinThreshold = 1 << 16;
+            struct Statistics
+            {
+                size_t Collections;
+                size_t Freed;
+                double TotalMilliseconds;
+                double MaxMilliseconds;
+            };
+            static Statistics &Totals()
+            {
+                static Statistics totals = { 0, 0, 0, 0 };
+                return totals;
+            }
+            /* Does nothing if terms are reference counted. */
+            static bool MaybeCollect(TermPtr const &target)
+            {
+                auto const &pool = Utilities::RefCountMemPool<Term>::Default;
+                auto &threshold = Threshold();
+                if (!Term::Traced || pool.LiveCount() < threshold)
+                {
+                    return false;
+                }
+                Collect(target);
+                threshold = pool.LiveCount() * 2;
+                if (threshold < MinThreshold)
+                {
+                    threshold = MinThreshold;
+                }
+                return true;
+            }
+            /* Returns the number of terms freed. */
+            static size_t Collect(TermPtr const &target)
+            {
+                if (!Term::Traced)
+                {
+                    return 0;
+                }
+                auto const started = Clock::now();
+                std::vector<TermPtr const *> pending(1, &target);
+                for (auto const source : Term::RootSources())
+                {
+                    source(pending);
+                }
+                std::vector<TermPtr const *> roots;
+                roots.swap(pending);
+                for (auto const root : roots)
+                {
+                    Push(pending, *root);
+                }
+                Mark(pending);
+                auto const freed = Utilities::RefCountMemPool<Term>::Default.Sweep();
+                auto const milliseconds = std::chrono::duration<double, std::milli>(
+                    Clock::now() - started).count();
+                auto &totals = Totals();
+                ++totals.Collections;
+                totals.Freed += freed;
+                totals.TotalMilliseconds += milliseconds;
+                if (milliseconds > totals.MaxMilliseconds)
+                {
+                    totals.MaxMilliseconds = milliseconds;
+                }
+                return freed;
+            }
+            /* Frees every term, as nothing is marked. For the end of
+             * the program, after which no term may be used. */
+            static void ReleaseAll()
+            {
+                Utilities::RefCountMemPool<Term>::Default.Sweep();
+            }
+        private:
+            typedef std::chrono::steady_clock Clock;
+            static size_t &Threshold()
+            {
+                static size_t threshold = MinThreshold;
+                return threshold;
+            }
+            static void Push(std::vector<TermPtr const *> &pending, TermPtr const &term)
+            {
+                if (term.Mark())
+                {
+                    pending.push_back(&term);
+                }
+            }
+            static void Mark(std::vector<TermPtr const *> &pending)
+            {
+                while (!pending.empty())
+                {
+                    auto const term = pending.back()->RawPtr();
+                    pending.pop_back();
+                    switch (term->Kind)
+                    {
+                        case Term::BoundVariableTerm:
+                            Push(pending, term->AsBoundVariable.BoundBy);
+                            break;
+                        case Term::AbstractionTerm:
+                        {
+                            Push(pending, term->AsAbstraction.Result);
+                            Push(pending, term->AsAbstraction.Variable);
+                            /* The shared terms of a template might
+                             * no longer be part of the body. */
+                            auto const &compiled = term->AsAbstraction.Compiled;
+                            if (compiled.Is<InstantiationTemplate>())
+                            {
+                                auto const instantiation = compiled.RawPtrUnsafe<InstantiationTemplate>();
+                                for (size_t i = 0; i != instantiation->Length; ++i)
+                                {
+                                    Push(pending, instantiation->Code[i].Shared);
+                                }
+                            }
+                            break;
+                        }
+                        case Term::ApplicationTerm:
+                            Push(pending, term->AsApplication.Function);
+                            Push(pending, term->AsApplication.Replaced);
+                            break;
+                        case Term::IndirectionTerm:
+                            Push(pending, term->AsIndirection.Target);
+                            break;
+                        case Term::SubstitutionTerm:
+                            Push(pending, term->AsSubstitution.Body);
+                            for (auto binding = term->AsSubstitution.Environment.RawPtr();
+                                (bool)binding; binding = binding->Next.RawPtr())
+                            {
+                                Push(pending, binding->Binder);
+                                Push(pending, binding->Replaced);
+                            }
+                            break;
+                        case Term::ReferenceTerm:
+                            Push(pending, term->AsReference.Target);
+                            break;
+                    }
+                }
+            }
+        };
+
+        /* Encodes a term as a sequence of cells in preorder, with
+         * variables as de Bruijn indices, so that alpha-equivalent
+         * terms have equal encodings whatever their sharing, and
+         * hashes the encoding. Encoding pushes substitutions down,
+         * like visitors do. */
+        struct StructuralEncoder
+        {
+            typedef size_t Cell;
+
+            StructuralEncoder() = default;
+            StructuralEncoder(StructuralEncoder const &) = delete;
+            StructuralEncoder(StructuralEncoder &&) = delete;
+            StructuralEncoder &operator = (StructuralEncoder const &) = delete;
+            StructuralEncoder &operator = (StructuralEncoder &&) = delete;
+            ~StructuralEncoder() = default;
+
+            /* Returns false if target has more than maxCells cells,
+             * or free variables other than the binders of outer
+             * (innermost last). */
+            bool Encode(Term *target, size_t maxCells, std::vector<Cell> &cells, size_t &hash,
+                std::vector<Term *> const &outer = std::vector<Term *>())
+            {
+                cells.clear();
+                binders.assign(outer.begin(), outer.end());
+                pending.clear();
+                pending.emplace_back(target, outer.size());
+                /* FNV-1a over the cells. */
+                hash = (size_t)14695981039346656037ull;
+                while (!pending.empty())
+                {
+                    if (cells.size() >= maxCells)
+                    {
+                        return false;
+                    }
+                    auto term = Term::Expose(pending.back().first);
+                    binders.resize(pending.back().second);
+                    pending.pop_back();
+                    Cell cell = term->Kind;
+                    switch (term->Kind)
+                    {
+                        case Term::BoundVariableTerm:
+                        {
+                            auto const binder = Term::SkipIndirections(term->AsBoundVariable.BoundBy.RawPtr());
+                            size_t index = 1;
+                            for (; index <= binders.size() && binders[binders.size() - index] != binder; ++index)
+                                ;
+                            if (index > binders.size())
+                            {
+                                return false;
+                            }
+                            cell |= index << KindBits;
+                            break;
+                        }
+                        case Term::AbstractionTerm:
+                            binders.push_back(term);
+                            pending.emplace_back(term->AsAbstraction.Result.RawPtr(), binders.size());
+                            break;
+                        case Term::ApplicationTerm:
+                            pending.emplace_back(term->AsApplication.Replaced.RawPtr(), binders.size());
+                            pending.emplace_back(term->AsApplication.Function.RawPtr(), binders.size());
+                            break;
+                        case Term::NativeTerm:
+                            cell |= (Cell)term->AsNative.Operation << KindBits;
+                            cells.push_back(cell);
+                            hash = (hash ^ cell) * (size_t)1099511628211ull;
+                            cell = term->AsNative.Value;
+                            break;
+                        case Term::ReferenceTerm:
+                            /* The name identifies the term referred to. */
+                            cell |= (Cell)term->AsReference.Name << KindBits;
+                            break;
+                        default:
+                            return false;
+                    }
+                    cells.push_back(cell);
+                    hash = (hash ^ cell) * (size_t)1099511628211ull;
+                }
+                return true;
+            }
+        private:
+            /* The kind is in the low bits, the rest is an index, a
+             * value or a name. */
+            static constexpr unsigned KindBits = 3;
+            /* Abstractions enclosing the node, innermost last. */
+            std::vector<Term *> binders;
+            /* Nodes to encode, and how many binders enclose them. */
+            std::vector<std::pair<Term *, size_t>> pending;
+        };
+
+        /* Finds out when a reduction returns to a term it has seen
+         * before, so that it never reaches a normal form, since the
+         * steps in between could be taken again forever. After each
+         * step, the term is encoded (StructuralEncoder), and the hash of
+         * the encoding is compared with a checkpoint kept from an
+         * earlier step, which moves to the current step whenever the
+         * number of steps since it reaches a power of two (Brent's
+         * algorithm), so a cycle is found within about twice the steps
+         * it takes to enter and go round it. Encodings are compared in
+         * full when the hashes match, so a collision cannot stop a
+         * reduction. Terms larger than MaxCells are not encoded, and
+         * start the search over after skipping twice as many steps as
+         * the last time, so that large terms cost little. */
+        struct CycleDetector
+        {
+            static constexpr size_t MaxCells = 1 << 12;
+
+            CycleDetector()
+            {
+                Reset();
+            }
+            CycleDetector(CycleDetector const &) = delete;
+            CycleDetector(CycleDetector &&) = delete;
+            CycleDetector &operator = (CycleDetector const &) = delete;
+            CycleDetector &operator = (CycleDetector &&) = delete;
+            ~CycleDetector() = default;
+
+            void Reset()
+            {
+                Restart();
+                skipped = 0;
+                skipping = 0;
+            }
+            /* Called after each step, returns the length of the cycle
+             * if target equals the term at the checkpoint, or 0. */
+            size_t Step(TermPtr const &target)
+            {
+                if (skipped != 0)
+                {
+                    --skipped;
+                    return 0;
+                }
+                size_t hash;
+                if (!encoder.Encode(target.RawPtr(), MaxCells, current, hash))
+                {
+                    Restart();
+                    skipping = skipping == 0 ? 1 : skipping * 2;
+                    skipped = skipping;
+                    return 0;
+                }
+                skipping = 0;
+                ++sinceCheckpoint;
+                if (!checkpoint.empty() && hash == checkpointHash && current == checkpoint)
+                {
+                    return sinceCheckpoint;
+                }
+                if (checkpoint.empty() || sinceCheckpoint == power)
+                {
+                    power = checkpoint.empty() ? 1 : power * 2;
+                    checkpoint.swap(current);
+                    checkpointHash = hash;
+                    sinceCheckpoint = 0;
+                }
+                return 0;
+            }
+        private:
+            std::vector<StructuralEncoder::Cell> checkpoint, current;
+            size_t checkpointHash, power, sinceCheckpoint;
+            /* Steps left to skip, and how many were skipped the last
+             * time, after terms too large to encode. */
+            size_t skipped, skipping;
+            StructuralEncoder encoder;
+
+            void Restart()
+            {
+                checkpoint.clear();
+                checkpointHash = 0;
+                power = 1;
+                sinceCheckpoint = 0;
+            }
+        };
+
+        typedef unsigned StatusKind;
+
+        struct Status
+        {
+            /* The session has not run yet, or has been reset. */
+            static constexpr StatusKind NotStarted = 0;
+            /* No more reduction is possible in the strategy. */
+            static constexpr StatusKind NormalForm = 1;
+            static constexpr StatusKind StepBudgetExhausted = 2;
+            static constexpr StatusKind TimeBudgetExhausted = 3;
+            static constexpr StatusKind NodeBudgetExhausted = 4;
+            /* Only for NormalisationByEvaluation. */
+            static constexpr StatusKind DepthLimitReached = 5;
+            /* The term returned to an earlier one (CycleDetector). */
+            static constexpr StatusKind Diverges = 6;
+            /* A native numeral is deeper than the largest literal,
+             * and is left native. */
+            static constexpr StatusKind NumeralTooDeep = 7;
+
+            static char const *Describe(StatusKind status)
+            {
+                switch (status)
+                {
+                    case NotStarted:
+                        return "not started";
+                    case NormalForm:
+                        return "normal form";
+                    case StepBudgetExhausted:
+                        return "step budget exhausted";
+                    case TimeBudgetExhausted:
+                        return "time budget exhausted";
+                    case NodeBudgetExhausted:
+                        return "node budget exhausted";
+                    case DepthLimitReached:
+                        return "evaluation depth limit reached";
+                    case Diverges:
+                        return "diverges";
+                    case NumeralTooDeep:
+                        return "numeral too deep to convert back";
+                    default:
+                        return "unknown";
+                }
+            }
+        };
+
+        typedef unsigned EtaPolicyKind;
+
+        /* When ReductionSession does eta-conversion. It is only done
+         * in full normalisation, because it looks under abstractions.
+         * Eta-conversion of a beta normal form is beta normal, so
+         * doing it once at the end gives the same normal form. */
+        struct EtaPolicy
+        {
+            static constexpr EtaPolicyKind EveryStep = 0;
+            static constexpr EtaPolicyKind AtEnd = 1;
+            static constexpr EtaPolicyKind Never = 2;
+        };
+
+        /* Limits of one ReductionSession::Run. Zero means unlimited.
+         * MaxLiveNodes counts the nodes live at once on top of those
+         * live when the run starts, so that the terms of the other
+         * identifiers do not count against it. */
+        struct Budget
+        {
+            size_t MaxSteps;
+            double MaxMilliseconds;
+            size_t MaxLiveNodes;
+            /* The same limits, with MaxLiveNodes as a limit on the
+             * live count of the pool, which is live now. */
+            Budget Starting(size_t live) const
+            {
+                Budget result = *this;
+                if (MaxLiveNodes != 0)
+                {
+                    result.MaxLiveNodes = live > (size_t)-1 - MaxLiveNodes
+                        ? (size_t)-1 : live + MaxLiveNodes;
+                }
+                return result;
+            }
+        };
+
+        /* Normalisation by evaluation. A term is evaluated into a
+         * value, where abstractions become closures and applications
+         * of variables become neutral values, and the value is read
+         * back (quoted) as a term in normal form. Arguments are
+         * evaluated on demand, at most once (call-by-need), and each
+         * value is quoted at most once, so sharing is preserved.
+         * This computes the same normal form as normal order, but
+         * no intermediate term is built. Native terms are evaluated
+         * in their Church forms. */
+        struct NormalisationByEvaluation
+        {
+            /* Nesting of evaluation allowed in the host stack. */
+            static constexpr size_t MaxDepth = 1 << 14;
+
+            /* Replaces target by its beta normal form. If a budget
+             * is exhausted, target is left untouched. Steps counts
+             * the applications of closures. Unless isolated, other
+             * references to target see the normal form too. */
+            static StatusKind Perform(TermPtr &target, Budget const &budget, size_t &steps,
+                bool isolated = false)
+            {
+                /* Values, thunks and lists do not outlive the call. */
+                Utilities::RefCountMemPool<Value>::Region values;
+                Utilities::RefCountMemPool<Thunk>::Region thunks;
+                Utilities::RefCountMemPool<List>::Region lists;
+                NormalisationByEvaluation instance(budget);
+                auto value = instance.Evaluate(target, nullptr);
+                auto result = (bool)value ? instance.Quote(value) : nullptr;
+                steps = instance.steps;
+                if (!(bool)result)
+                {
+                    return instance.status;
+                }
+                if (!isolated && target->Kind == Term::ApplicationTerm)
+                {
+                    target->Overwrite(result);
+                }
+                target = std::move(result);
+                return Status::NormalForm;
+            }
+        private:
+            struct Value;
+            struct Thunk;
+            struct List;
+            typedef Utilities::RefCountPtr<Value> ValuePtr;
+            typedef Utilities::RefCountPtr<Thunk> ThunkPtr;
+            typedef Utilities::RefCountPtr<List> ListPtr;
+            /* Environments map binders to thunks, innermost first.
+             * Spines of neutral values hold the arguments, last
+             * first, with null binders. */
+            struct List
+            {
+                Term const *Binder;
+                ThunkPtr Argument;
+                ListPtr Next;
+                List() = delete;
+                List(List const &) = delete;
+                List(List &&) = delete;
+                List &operator = (List const &) = delete;
+                List &operator = (List &&) = delete;
+                void DefaultConstructor()
+                {
+                    Binder = nullptr;
+                    Argument.DefaultConstructor();
+                    Next.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Argument.Finalise();
+                    Next.Finalise();
+                }
+            };
+            /* A closure if Abstraction is not null, and otherwise
+             * a variable applied to the spine. */
+            struct Value
+            {
+                TermPtr Abstraction;
+                ListPtr Environment;
+                TermPtr Variable;
+                ListPtr Spine;
+                /* Memoised result of Quote. */
+                TermPtr Quoted;
+                Value() = delete;
+                Value(Value const &) = delete;
+                Value(Value &&) = delete;
+                Value &operator = (Value const &) = delete;
+                Value &operator = (Value &&) = delete;
+                void DefaultConstructor()
+                {
+                    Abstraction.DefaultConstructor();
+                    Environment.DefaultConstructor();
+                    Variable.DefaultConstructor();
+                    Spine.DefaultConstructor();
+                    Quoted.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Abstraction.Finalise();
+                    Environment.Finalise();
+                    Variable.Finalise();
+                    Spine.Finalise();
+                    Quoted.Finalise();
+                }
+            };
+            /* A term to evaluate in an environment, replaced by
+             * its value when forced. */
+            struct Thunk
+            {
+                TermPtr Suspended;
+                ListPtr Environment;
+                ValuePtr Forced;
+                Thunk() = delete;
+                Thunk(Thunk const &) = delete;
+                Thunk(Thunk &&) = delete;
+                Thunk &operator = (Thunk const &) = delete;
+                Thunk &operator = (Thunk &&) = delete;
+                void DefaultConstructor()
+                {
+                    Suspended.DefaultConstructor();
+                    Environment.DefaultConstructor();
+                    Forced.DefaultConstructor();
+                }
+                void Finalise()
+                {
+                    Suspended.Finalise();
+                    Environment.Finalise();
+                    Forced.Finalise();
+                }
+            };
+            typedef std::chrono::steady_clock Clock;
+            NormalisationByEvaluation(Budget const &budget)
+                : budget(budget), started(Clock::now()),
+                steps(0), depth(0), status(Status::NormalForm)
+            { }
+            NormalisationByEvaluation(NormalisationByEvaluation &&) = default;
+            NormalisationByEvaluation(NormalisationByEvaluation const &) = default;
+            NormalisationByEvaluation &operator = (NormalisationByEvaluation &&) = delete;
+            NormalisationByEvaluation &operator = (NormalisationByEvaluation const &) = delete;
+            ~NormalisationByEvaluation() = default;
+            Budget const &budget;
+            Clock::time_point const started;
+            size_t steps;
+            size_t depth;
+            /* Set to the reason of stopping. */
+            StatusKind status;
+            static size_t LiveCount()
+            {
+                return Utilities::RefCountMemPool<Term>::Default.LiveCount()
+                    + Utilities::RefCountMemPool<Value>::Default.LiveCount()
+                    + Utilities::RefCountMemPool<Thunk>::Default.LiveCount()
+                    + Utilities::RefCountMemPool<List>::Default.LiveCount();
+            }
+            /* Returns whether evaluation may go on. The clock
+             * is only read once every 1024 steps. */
+            bool CheckBudget()
+            {
+                if (status != Status::NormalForm)
+                {
+                    return false;
+                }
+                if (budget.MaxSteps != 0 && steps == budget.MaxSteps)
+                {
+                    status = Status::StepBudgetExhausted;
+                }
+                else if (budget.MaxLiveNodes != 0 && LiveCount() > budget.MaxLiveNodes)
+                {
+                    status = Status::NodeBudgetExhausted;
+                }
+                else if (budget.MaxMilliseconds > 0 && steps % 1024 == 0
+                    && std::chrono::duration<double, std::milli>(
+                        Clock::now() - started).count() >= budget.MaxMilliseconds)
+                {
+                    status = Status::TimeBudgetExhausted;
+                }
+                return status == Status::NormalForm;
+            }
+            static ListPtr Bind(Term const *binder, ThunkPtr argument, ListPtr next)
+            {
+                ListPtr result;
+                auto list = result.NewInstance();
+                list->Binder = binder;
+                list->Argument = std::move(argument);
+                list->Next = std::move(next);
+                return result;
+            }
+            static ThunkPtr Evaluated(ValuePtr value)
+            {
+                ThunkPtr result;
+                result.NewInstance()->Forced = std::move(value);
+                return result;
+            }
+            /* Returns null if evaluation stops. */
+            ValuePtr Evaluate(TermPtr const &target, ListPtr const &environment)
+            {
+                if (depth == MaxDepth)
+                {
+                    status = Status::DepthLimitReached;
+                    return nullptr;
+                }
+                ++depth;
+                auto result = EvaluateNested(Term::Expose(target), environment);
+                --depth;
+                return result;
+            }
+            ValuePtr EvaluateNested(TermPtr const &target, ListPtr const &environment)
+            {
+                switch (target->Kind)
+                {
+                    case Term::BoundVariableTerm:
+                    {
+                        return Force(Lookup(target, environment));
+                    }
+                    case Term::AbstractionTerm:
+                    {
+                        ValuePtr result;
+                        auto closure = result.NewInstance();
+                        closure->Abstraction = target;
+                        closure->Environment = environment;
+                        return result;
+                    }
+                    case Term::ApplicationTerm:
+                    {
+                        auto func = Evaluate(target->AsApplication.Function, environment);
+                        if (!(bool)func)
+                        {
+                            return nullptr;
+                        }
+                        return Apply(func, Suspend(target->AsApplication.Replaced, environment));
+                    }
+                    case Term::NativeTerm:
+                    {
+                        return Evaluate(NativeArithmetic::Materialised(target), nullptr);
+                    }
+                    case Term::ReferenceTerm:
+                    {
+                        return Evaluate(target->AsReference.Target, nullptr);
+                    }
+                    default:
+                    {
+                        return nullptr;
+                    }
+                }
+            }
+            static ThunkPtr const &Lookup(TermPtr const &variable, ListPtr const &environment)
+            {
+                auto const binder = variable->AsBoundVariable.BoundBy.RawPtr();
+                auto list = environment.RawPtr();
+                while (list->Binder != binder)
+                {
+                    list = list->Next.RawPtr();
+                }
+                return list->Argument;
+            }
+            /* Variables and abstractions are cheap to evaluate, so
+             * they are not suspended. */
+            ThunkPtr Suspend(TermPtr const &target, ListPtr const &environment)
+            {
+                auto const &term = Term::Expose(target);
+                if (term->Kind == Term::BoundVariableTerm)
+                {
+                    return Lookup(term, environment);
+                }
+                if (term->Kind == Term::AbstractionTerm)
+                {
+                    return Evaluated(EvaluateNested(term, environment));
+                }
+                ThunkPtr result;
+                auto thunk = result.NewInstance();
+                thunk->Suspended = term;
+                thunk->Environment = environment;
+                return result;
+            }
+            ValuePtr Force(ThunkPtr const &thunk)
+            {
+                if (!(bool)thunk->Forced)
+                {
+                    thunk->Forced = Evaluate(thunk->Suspended, thunk->Environment);
+                    if (!(bool)thunk->Forced)
+                    {
+                        return nullptr;
+                    }
+                    thunk->Suspended = nullptr;
+                    thunk->Environment = nullptr;
+                }
+                return thunk->Forced;
+            }
+            ValuePtr Apply(ValuePtr const &func, ThunkPtr argument)
+            {
+                if ((bool)func->Abstraction)
+                {
+                    if (!CheckBudget())
+                    {
+                        return nullptr;
+                    }
+                    ++steps;
+                    return Instantiate(func, std::move(argument));
+                }
+                ValuePtr result;
+                auto neutral = result.NewInstance();
+                neutral->Variable = func->Variable;
+                neutral->Spine = Bind(nullptr, std::move(argument), func->Spine);
+                return result;
+            }
+            ValuePtr Instantiate(ValuePtr const &closure, ThunkPtr argument)
+            {
+                auto const &abstraction = closure->Abstraction;
+                return Evaluate(abstraction->AsAbstraction.Result,
+                    Bind(abstraction.RawPtr(), std::move(argument), closure->Environment));
+            }
+            /* Returns null if evaluation stops. */
+            TermPtr Quote(ValuePtr const &value)
+            {
+                if ((bool)value->Quoted)
+                {
+                    return value->Quoted;
+                }
+                if (depth == MaxDepth)
+                {
+                    status = Status::DepthLimitReached;
+                    return nullptr;
+                }
+                ++depth;
+                TermPtr result = (bool)value->Abstraction
+                    ? QuoteClosure(value)
+                    : QuoteNeutral(value->Variable, value->Spine.RawPtr());
+                --depth;
+                if ((bool)result)
+                {
+                    result->Normal = true;
+                    value->Quoted = result;
+                }
+                return result;
+            }
+            /* The closure is instantiated with a fresh variable. */
+            TermPtr QuoteClosure(ValuePtr const &closure)
+            {
+                TermPtr abstraction, variable;
+                abstraction.NewInstance();
+                variable.NewInstance()->BoundVariableConstructor(abstraction);
+                variable->Normal = true;
+                ValuePtr neutral;
+                neutral.NewInstance()->Variable = variable;
+                auto body = Instantiate(closure, Evaluated(std::move(neutral)));
+                auto quoted = (bool)body ? Quote(body) : nullptr;
+                if (!(bool)quoted)
+                {
+                    return nullptr;
+                }
+                abstraction->AbstractionConstructor(std::move(variable), std::move(quoted));
+                return abstraction;
+            }
+            TermPtr QuoteNeutral(TermPtr const &variable, List const *spine)
+            {
+                if (!(bool)spine)
+                {
+                    return variable;
+                }
+                if (depth == MaxDepth)
+                {
+                    status = Status::DepthLimitReached;
+                    return nullptr;
+                }
+                ++depth;
+                auto func = QuoteNeutral(variable, spine->Next.RawPtr());
+                auto argument = (bool)func ? Force(spine->Argument) : nullptr;
+                auto rplc = (bool)argument ? Quote(argument) : nullptr;
+                --depth;
+                if (!(bool)rplc)
+                {
+                    return nullptr;
+                }
+                TermPtr result;
+                result.NewInstance()->ApplicationConstructor(std::move(func), std::move(rplc));
+                result->Normal = true;
+                return result;
+            }
+        };
+
+        typedef unsigned AnswerKind;
+
+        struct Answer
+        {
+            static constexpr AnswerKind Yes = 0;
+            static constexpr AnswerKind No = 1;
+            /* A budget was exhausted before the answer was found. */
+            static constexpr AnswerKind Unknown = 2;
+
+            static char const *Describe(AnswerKind answer)
+            {
+                switch (answer)
+                {
+                    case Yes:
+                        return "yes";
+                    case No:
+                        return "no";
+                    case Unknown:
+                        return "unknown";
+                    default:
+                        return "invalid";
+                }
+            }
+        };
+
+        /* Decides whether two closed terms are beta-eta-equivalent.
+         * Terms that are alpha-equivalent already are found by their
+         * encodings (StructuralEncoder), hashes first, and so are the
+         * small pairs compared below before they are reduced. Otherwise, both
+         * are reduced to head normal forms with sharing, and after the
+         * side with fewer abstractions is eta-expanded, their head
+         * variables must be bound at the same depth and applied to as
+         * many arguments, which are then compared in pairs, breadth
+         * first (Boehm trees). Since equivalent head normal forms have
+         * matching heads, the first mismatch answers No without
+         * reducing the rest. A pair without a head normal form uses up
+         * the budget, so the answer is Unknown. The terms are reduced
+         * copy-on-write (CopyOnWrite), so neither they nor the terms
+         * sharing nodes with them are changed. References with
+         * different names are unfolded, and native terms other than
+         * numerals on both sides are converted back. */
+        struct BetaEtaEquivalence
+        {
+            /* Steps counts the beta-reductions and the unfoldings. */
+            static AnswerKind Perform(TermPtr const &left, TermPtr const &right,
+                Budget const &budget, size_t &steps)
+            {
+                BetaEtaEquivalence instance(budget);
+                auto const answer = instance.Compare(left, right);
+                steps = instance.steps;
+                return answer;
+            }
+        private:
+            typedef std::chrono::steady_clock Clock;
+            /* Terms larger than this are not compared as a whole,
+             * and pairs larger than MaxPairCells are not compared
+             * before they are reduced. */
+            static constexpr size_t MaxCells = 1 << 16;
+            static constexpr size_t MaxPairCells = 1 << 10;
+            /* The binders of both sides at one depth, and the index
+             * of the enclosing level plus one, or 0 at the top. */
+            struct Level
+            {
+                Term *Left, *Right;
+                size_t Outer;
+                /* Whether the binders are the same at every depth
+                 * up to this one. */
+                bool Same;
+            };
+            struct Pair
+            {
+                TermPtr Left, Right;
+                /* The innermost level plus one, or 0 at the top. */
+                size_t Context;
+            };
+            /* A head normal form: abstractions, then the head applied
+             * to arguments. */
+            struct Spine
+            {
+                std::vector<Term *> Binders;
+                TermPtr Head;
+                std::vector<TermPtr> Arguments;
+            };
+            /* MaxLiveNodes counts from the start of the comparison. */
+            Budget const budget;
+            size_t steps;
+            Clock::time_point started;
+            std::vector<Level> levels;
+            std::deque<Pair> pending;
+            /* The binders added by eta-expansion, and the head
+             * normal forms whose binders are levels, which might
+             * be copies that nothing else holds. */
+            std::vector<TermPtr> expansions;
+            StructuralEncoder encoder;
+            /* Pairs left to skip, and how many were skipped the last
+             * time, after pairs too large to encode. */
+            size_t skipped, skipping;
+            std::vector<Term *> leftBinders, rightBinders;
+            std::vector<StructuralEncoder::Cell> leftCells, rightCells;
+
+            explicit BetaEtaEquivalence(Budget const &budget)
+                : budget(budget.Starting(Utilities::RefCountMemPool<Term>::Default.LiveCount())),
+                steps(0), started(Clock::now()),
+                skipped(0), skipping(0)
+            {
+            }
+            BetaEtaEquivalence(BetaEtaEquivalence const &) = delete;
+            BetaEtaEquivalence(BetaEtaEquivalence &&) = delete;
+            BetaEtaEquivalence &operator = (BetaEtaEquivalence const &) = delete;
+            BetaEtaEquivalence &operator = (BetaEtaEquivalence &&) = delete;
+            ~BetaEtaEquivalence() = default;
+
+            AnswerKind Compare(TermPtr const &left, TermPtr const &right)
+            {
+                if (AlphaEquivalent(left, right, 0, MaxCells))
+                {
+                    return Answer::Yes;
+                }
+                pending.push_back(Pair { left, right, 0 });
+                while (!pending.empty())
+                {
+                    auto pair = std::move(pending.front());
+                    pending.pop_front();
+                    bool const same = pair.Context == 0 || levels[pair.Context - 1].Same;
+                    if ((same && Term::SkipIndirections(pair.Left.RawPtr()) == Term::SkipIndirections(pair.Right.RawPtr()))
+                        || (pair.Context != 0
+                            && (HasHeadRedex(pair.Left) || HasHeadRedex(pair.Right))
+                            && SmallAndAlphaEquivalent(pair)))
+                    {
+                        continue;
+                    }
+                    if (!HeadNormalise(pair.Left) || !HeadNormalise(pair.Right))
+                    {
+                        return Answer::Unknown;
+                    }
+                    Spine left, right;
+                    Analyse(pair.Left, left);
+                    Analyse(pair.Right, right);
+                    if (IsNumeral(left) && IsNumeral(right))
+                    {
+                        /* Church numerals are distinct normal forms. */
+                        if (left.Head->AsNative.Value != right.Head->AsNative.Value)
+                        {
+                            return Answer::No;
+                        }
+                        continue;
+                    }
+                    if (!left.Binders.empty() || !right.Binders.empty())
+                    {
+                        expansions.push_back(std::move(pair.Left));
+                        expansions.push_back(std::move(pair.Right));
+                    }
+                    ExpandEta(left, right.Binders.size());
+                    ExpandEta(right, left.Binders.size());
+                    auto context = pair.Context;
+                    for (size_t i = 0; i != left.Binders.size(); ++i)
+                    {
+                        bool const outerSame = context == 0 || levels[context - 1].Same;
+                        levels.push_back(Level { left.Binders[i], right.Binders[i], context,
+                            outerSame && left.Binders[i] == right.Binders[i] });
+                        context = levels.size();
+                    }
+                    auto const leftKind = left.Head->Kind;
+                    auto const rightKind = right.Head->Kind;
+                    if (leftKind == Term::NativeTerm || rightKind == Term::NativeTerm
+                        || ((leftKind == Term::ReferenceTerm || rightKind == Term::ReferenceTerm)
+                            && !(leftKind == rightKind
+                                && std::strcmp(left.Head->AsReference.Name, right.Head->AsReference.Name) == 0)))
+                    {
+                        if (!CheckBudget() || !Affordable(left) || !Affordable(right))
+                        {
+                            return Answer::Unknown;
+                        }
+                        ++steps;
+                        pending.push_front(Pair { Unfold(left), Unfold(right), context });
+                        continue;
+                    }
+                    if (leftKind == Term::BoundVariableTerm && rightKind == Term::BoundVariableTerm)
+                    {
+                        auto const leftIndex = IndexOf(context, left.Head, &Level::Left);
+                        auto const rightIndex = IndexOf(context, right.Head, &Level::Right);
+                        if (leftIndex == 0 || rightIndex == 0)
+                        {
+                            return Answer::Unknown;
+                        }
+                        if (leftIndex != rightIndex)
+                        {
+                            return Answer::No;
+                        }
+                    }
+                    else if (leftKind != Term::ReferenceTerm || rightKind != Term::ReferenceTerm)
+                    {
+                        return Answer::Unknown;
+                    }
+                    if (left.Arguments.size() != right.Arguments.size())
+                    {
+                        return Answer::No;
+                    }
+                    for (size_t i = 0; i != left.Arguments.size(); ++i)
+                    {
+                        pending.push_back(Pair { std::move(left.Arguments[i]), std::move(right.Arguments[i]), context });
+                    }
+                }
+                return Answer::Yes;
+            }
+            /* After pairs too large to encode, skips twice as many
+             * pairs as the last time. */
+            bool SmallAndAlphaEquivalent(Pair const &pair)
+            {
+                if (skipped != 0)
+                {
+                    --skipped;
+                    return false;
+                }
+                bool large = false;
+                bool const equivalent = AlphaEquivalent(pair.Left, pair.Right, pair.Context, MaxPairCells, &large);
+                skipping = !large ? 0 : skipping == 0 ? 1 : skipping * 2;
+                skipped = skipping;
+                return equivalent;
+            }
+            /* Compares the encodings, in which the variables bound
+             * at the levels of the context are numbered on. */
+            bool AlphaEquivalent(TermPtr const &left, TermPtr const &right,
+                size_t context, size_t maxCells, bool *large = nullptr)
+            {
+                leftBinders.clear();
+                rightBinders.clear();
+                for (; context != 0; context = levels[context - 1].Outer)
+                {
+                    leftBinders.push_back(levels[context - 1].Left);
+                    rightBinders.push_back(levels[context - 1].Right);
+                }
+                std::reverse(leftBinders.begin(), leftBinders.end());
+                std::reverse(rightBinders.begin(), rightBinders.end());
+                size_t leftHash, rightHash;
+                if (!encoder.Encode(left.RawPtr(), maxCells, leftCells, leftHash, leftBinders)
+                    || !encoder.Encode(right.RawPtr(), maxCells, rightCells, rightHash, rightBinders))
+                {
+                    if (large != nullptr)
+                    {
+                        *large = true;
+                    }
+                    return false;
+                }
+                return leftHash == rightHash && leftCells == rightCells;
+            }
+            bool CheckBudget() const
+            {
+                auto const &pool = Utilities::RefCountMemPool<Term>::Default;
+                return (budget.MaxSteps == 0 || steps < budget.MaxSteps)
+                    && (budget.MaxLiveNodes == 0 || pool.LiveCount() <= budget.MaxLiveNodes)
+                    && (budget.MaxMilliseconds <= 0
+                        || std::chrono::duration<double, std::milli>(Clock::now() - started).count()
+                            < budget.MaxMilliseconds);
+            }
+            bool HeadNormalise(TermPtr &target)
+            {
+                while (true)
+                {
+                    if (!CheckBudget())
+                    {
+                        return false;
+                    }
+                    if (!BetaReduction::Perform(target, Strategy::HeadNormalForm,
+                        Instantiation::Copy, true))
+                    {
+                        return true;
+                    }
+                    ++steps;
+                }
+            }
+            /* Whether reducing target to head normal form takes a
+             * step, in which case it might not terminate. */
+            static bool HasHeadRedex(TermPtr const &target)
+            {
+                auto term = Term::Expose(target.RawPtr());
+                for (; term->Kind == Term::AbstractionTerm;
+                    term = Term::Expose(term->AsAbstraction.Result.RawPtr()))
+                    ;
+                if (term->Kind != Term::ApplicationTerm)
+                {
+                    return false;
+                }
+                for (; term->Kind == Term::ApplicationTerm;
+                    term = Term::Expose(term->AsApplication.Function.RawPtr()))
+                    ;
+                return term->Kind == Term::AbstractionTerm || term->Kind == Term::ReferenceTerm
+                    || term->Kind == Term::NativeTerm;
+            }
+            static void Analyse(TermPtr const &target, Spine &spine)
+            {
+                auto term = &Term::Expose(target);
+                for (; (*term)->Kind == Term::AbstractionTerm;
+                    term = &Term::Expose((*term)->AsAbstraction.Result))
+                {
+                    spine.Binders.push_back(term->RawPtr());
+                }
+                for (; (*term)->Kind == Term::ApplicationTerm;
+                    term = &Term::Expose((*term)->AsApplication.Function))
+                {
+                    spine.Arguments.push_back((*term)->AsApplication.Replaced);
+                }
+                std::reverse(spine.Arguments.begin(), spine.Arguments.end());
+                spine.Head = *term;
+            }
+            /* Adds abstractions up to count, applying the head to
+             * their variables. */
+            void ExpandEta(Spine &spine, size_t count)
+            {
+                while (spine.Binders.size() < count)
+                {
+                    TermPtr binder, variable;
+                    binder.NewInstance();
+                    variable.NewInstance()->BoundVariableConstructor(binder);
+                    binder->AbstractionConstructor(variable, variable);
+                    spine.Binders.push_back(binder.RawPtr());
+                    spine.Arguments.push_back(std::move(variable));
+                    expansions.push_back(std::move(binder));
+                }
+            }
+            /* The depth of the binder of variable, counted from the
+             * innermost level, or 0 if it is not bound there. */
+            size_t IndexOf(size_t context, TermPtr const &variable, Term *Level::*side) const
+            {
+                auto const binder = Term::SkipIndirections(variable->AsBoundVariable.BoundBy.RawPtr());
+                size_t index = 1;
+                for (; context != 0 && levels[context - 1].*side != binder;
+                    context = levels[context - 1].Outer, ++index)
+                    ;
+                return context == 0 ? 0 : index;
+            }
+            /* A native numeral that is not applied nor under an
+             * abstraction. */
+            static bool IsNumeral(Spine const &spine)
+            {
+                return spine.Head->Kind == Term::NativeTerm
+                    && spine.Head->AsNative.Operation == Term::NativeNumeral
+                    && spine.Binders.empty() && spine.Arguments.empty();
+            }
+            /* Whether the Church form of a native numeral head fits
+             * in the node budget. */
+            bool Affordable(Spine const &spine) const
+            {
+                auto const live = Utilities::RefCountMemPool<Term>::Default.LiveCount();
+                return budget.MaxLiveNodes == 0
+                    || spine.Head->Kind != Term::NativeTerm
+                    || spine.Head->AsNative.Operation != Term::NativeNumeral
+                    || (live <= budget.MaxLiveNodes
+                        && spine.Head->AsNative.Value <= budget.MaxLiveNodes - live);
+            }
+            /* The head applied to the arguments, with a reference
+             * replaced by its target, and a native term by its Church
+             * form. */
+            static TermPtr Unfold(Spine const &spine)
+            {
+                TermPtr result = spine.Head->Kind == Term::ReferenceTerm
+                    ? TermPtr(spine.Head->AsReference.Target)
+                    : spine.Head->Kind == Term::NativeTerm
+                    ? NativeArithmetic::Materialised(spine.Head)
+                    : spine.Head;
+                for (auto const &argument : spine.Arguments)
+                {
+                    TermPtr application;
+                    application.NewInstance()->ApplicationConstructor(std::move(result), argument);
+                    result = std::move(application);
+                }
+                return result;
+            }
+        };
+
+        /* Repeated eta-conversion and beta-reduction of a term.
+         * The session remembers where it stopped, so that a later
+         * Run with the same strategy continues with a fresh budget,
+         * and a term already in normal form is not scanned again.
+         * It also keeps the RedexCursor of the last step, which a
+         * later Run follows unless another session has run since.
+         * The session does not hold the term, so the owner must
+         * Reset it whenever the term is replaced by another one.
+         */
+        struct ReductionSession
+        {
+            ReductionSession(StrategyKind strategy = Strategy::NormalOrder)
+                : unmaterialised(false), cursorRun(0)
+            {
+                Reset(strategy);
+            }
+            StrategyKind UsedStrategy;
+            EtaPolicyKind Eta;
+            /* Whether to use native terms and delta rules for
+             * Church-encoded arithmetic during Run. */
+            bool Native;
+            /* Whether to use NormalisationByEvaluation instead of
+             * stepping. Only meaningful for normal order, and not
+             * combined with Native. */
+            bool Evaluate;
+            InstantiationKind Instantiate;
+            /* Whether Run leaves the nodes shared with other terms
+             * untouched, by copying them on write. */
+            bool Isolate;
+            /* Whether Run stops when the term returns to an earlier
+             * one (CycleDetector). Costs a traversal of the term per
+             * step while the term is small. Ignored by Evaluate. */
+            bool Detect;
+            StatusKind LastStatus;
+            /* Steps after which the term repeats, if it diverges. */
+            size_t CycleLength;
+            size_t LastSteps, TotalSteps;
+            /* Term nodes allocated, whether or not still alive. */
+            size_t LastAllocations, TotalAllocations;
+            double LastMilliseconds, TotalMilliseconds;
+            unsigned Runs;
+
+            void Reset(StrategyKind strategy)
+            {
+                UsedStrategy = strategy;
+                Eta = EtaPolicy::EveryStep;
+                Native = false;
+                Evaluate = false;
+                Instantiate = Instantiation::Copy;
+                Isolate = false;
+                Detect = false;
+                LastStatus = Status::NotStarted;
+                CycleLength = 0;
+                cycles.Reset();
+                LastSteps = 0;
+                TotalSteps = 0;
+                LastAllocations = 0;
+                TotalAllocations = 0;
+                LastMilliseconds = 0;
+                TotalMilliseconds = 0;
+                Runs = 0;
+                cursor.Clear();
+            }
+
+            StatusKind Run(TermPtr &target, Budget const &requested)
+            {
+                LastSteps = 0;
+                LastAllocations = 0;
+                LastMilliseconds = 0;
+                if (LastStatus == Status::NormalForm || LastStatus == Status::Diverges)
+                {
+                    return LastStatus;
+                }
+                ++Runs;
+                if (cursorRun != AllRuns())
+                {
+                    cursor.Clear();
+                }
+                cursorRun = ++AllRuns();
+                auto const &pool = Utilities::RefCountMemPool<Term>::Default;
+                auto const budget = requested.Starting(pool.LiveCount());
+                auto const allocated = pool.AllocationCount();
+                auto const started = Clock::now();
+                if (Evaluate)
+                {
+                    /* Evaluation does not resume, but starts over, so
+                     * the totals are those of this run. */
+                    cursor.Clear();
+                    LastStatus = NormalisationByEvaluation::Perform(target, budget, LastSteps, Isolate);
+                    if (LastStatus == Status::NormalForm
+                        && Eta != EtaPolicy::Never
+                        && EtaConversion::Perform(target, Isolate))
+                    {
+                        ++LastSteps;
+                    }
+                    LastMilliseconds = Elapsed(started);
+                    LastAllocations = pool.AllocationCount() - allocated;
+                    TotalSteps = LastSteps;
+                    TotalAllocations = LastAllocations;
+                    TotalMilliseconds = LastMilliseconds;
+                    return LastStatus;
+                }
+                if (Native)
+                {
+                    /* Recognition rewrites the nodes it passes, and
+                     * so do the delta rules, but other terms may share
+                     * them and must never see native terms. So the
+                     * term is relocated first, which copies it with
+                     * its own sharing, together with the recursive
+                     * definitions it refers to. The references to
+                     * the copies are put back by materialisation. */
+                    {
+                        cursor.Clear();
+                        Compaction compaction(true);
+                        target = compaction.Relocate(target);
+                        references = compaction.References();
+                        /* Until here, only the compaction holds the
+                         * copies of the definitions. */
+                        for (auto const &reference : references)
+                        {
+                            recursives.push_back(reference.first->AsReference.Target);
+                        }
+                    }
+                    RecogniseNativeTerms::Perform(target);
+                    for (size_t i = 0; i != references.size(); ++i)
+                    {
+                        RecogniseNativeTerms::Perform(recursives[i]);
+                        references[i].first->Tie(recursives[i]);
+                    }
+                }
+                LastStatus = Loop(target, budget, started);
+                /* Native terms are not kept between runs, unless
+                 * their Church forms exceed the node budget, and then
+                 * the next run converts them. Converting them back
+                 * might create redexes (partially applied combinators)
+                 * or eta-redexes (numeral 1). */
+                if (Native || unmaterialised)
+                {
+                    bool combinators, deep;
+                    unmaterialised = !MaterialiseNativeTerms::Perform(target, budget.MaxLiveNodes,
+                        combinators, deep, references);
+                    references.clear();
+                    recursives.clear();
+                    cursor.Clear();
+                    if (unmaterialised)
+                    {
+                        LastStatus = deep ? Status::NumeralTooDeep : Status::NodeBudgetExhausted;
+                    }
+                    else if (LastStatus == Status::NormalForm)
+                    {
+                        LastStatus = Loop(target, budget, started);
+                    }
+                }
+                LastMilliseconds = Elapsed(started);
+                LastAllocations = pool.AllocationCount() - allocated;
+                TotalSteps += LastSteps;
+                TotalAllocations += LastAllocations;
+                TotalMilliseconds += LastMilliseconds;
+                return LastStatus;
+            }
+        private:
+            typedef std::chrono::steady_clock Clock;
+            CycleDetector cycles;
+            /* Whether the last Run left native numerals in the term.
+             * Kept by Reset, since the term still has them. */
+            bool unmaterialised;
+            /* During a native Run, the copies of the references in
+             * the term with their originals, and the copies of the
+             * recursive definitions they refer to. */
+            std::vector<std::pair<TermPtr, TermPtr>> references;
+            std::vector<TermPtr> recursives;
+            RedexCursor cursor;
+            /* The value of AllRuns when the cursor was saved. */
+            size_t cursorRun;
+            /* The runs of all sessions, since a run of another session
+             * may rewrite nodes shared with this term. */
+            static size_t &AllRuns()
+            {
+                static size_t runs = 0;
+                return runs;
+            }
+            static double Elapsed(Clock::time_point started)
+            {
+                return std::chrono::duration<double, std::milli>(
+                    Clock::now() - started).count();
+            }
+            StatusKind Loop(TermPtr &target, Budget const &budget, Clock::time_point started)
+            {
+                auto const &pool = Utilities::RefCountMemPool<Term>::Default;
+                bool const full = Strategy::IsFull(UsedStrategy);
+                bool const etaEveryStep = full && Eta == EtaPolicy::EveryStep;
+                bool const etaAtEnd = full && Eta == EtaPolicy::AtEnd;
+                while (true)
+                {
+                    TracingCollector::MaybeCollect(target);
+                    if (budget.MaxSteps != 0 && LastSteps == budget.MaxSteps)
+                    {
+                        return Status::StepBudgetExhausted;
+                    }
+                    if (budget.MaxLiveNodes != 0 && pool.LiveCount() > budget.MaxLiveNodes)
+                    {
+                        return Status::NodeBudgetExhausted;
+                    }
+                    if (budget.MaxMilliseconds > 0
+                        && Elapsed(started) >= budget.MaxMilliseconds)
+                    {
+                        return Status::TimeBudgetExhausted;
+                    }
+                    /* The cursor saves the search for the redex, but
+                     * eta-conversion every step still scans the term. */
+                    if (etaEveryStep && EtaConversion::Perform(target, Isolate))
+                    {
+                        cursor.Clear();
+                    }
+                    else if (!BetaReduction::Perform(target, UsedStrategy, Instantiate, Isolate, &cursor))
+                    {
+                        if (etaAtEnd && EtaConversion::Perform(target, Isolate))
+                        {
+                            ++LastSteps;
+                        }
+                        return Status::NormalForm;
+                    }
+                    ++LastSteps;
+                    if (Detect && (bool)(CycleLength = cycles.Step(target)))
+                    {
+                        return Status::Diverges;
+                    }
+                }
             }
         };
     }
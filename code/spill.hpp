@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef SPILL_HPP_
+#define SPILL_HPP_ 1
+
+#include"utils.hpp"
+#include<cstddef>
+#include<cstdlib>
+#include<string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<unistd.h>
+#define UTILITIES_SPILL_MMAP 1
+#endif
+
+namespace Utilities
+{
+    /* A file mapped into memory (the spill file), from which pools
+     * take their blocks (RefCountMemPool::SetBlockSource), so that
+     * the kernel can write cold pages of large terms back to the
+     * file instead of running out of memory. The whole file is
+     * mapped at once, so the blocks never move, and the pointers
+     * into them stay ordinary pointers. The file is unlinked as soon
+     * as it is mapped, and the mapping is kept until the program
+     * exits, since the pools never give their blocks back. Writing
+     * to the mapping raises SIGBUS if the disk is full. */
+    struct SpillFile
+    {
+        /* Blocks are aligned to this many bytes. */
+        static constexpr size_t Alignment = 64;
+
+        /* Creates a file with a new name in the directory, of the
+         * given size, and maps it. Only one file can be mapped. */
+        static bool Open(char const *directory, size_t bytes, char const *&err)
+        {
+            auto &state = Current();
+            if ((bool)state.Base)
+            {
+                err = "A spill file is already mapped.";
+                return false;
+            }
+#ifdef UTILITIES_SPILL_MMAP
+            std::string path = directory;
+            path += "/lambda-calculus-spill-XXXXXX";
+            int const file = mkstemp(&path[0]);
+            if (file == -1)
+            {
+                err = "Cannot create the spill file.";
+                return false;
+            }
+            void *base = MAP_FAILED;
+            if (ftruncate(file, (off_t)bytes) == 0)
+            {
+                base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_NORESERVE, file, 0);
+            }
+            close(file);
+            unlink(path.c_str());
+            if (base == MAP_FAILED)
+            {
+                err = "Cannot map the spill file.";
+                return false;
+            }
+            state.Base = (char *)base;
+            state.Size = bytes;
+            state.Used = 0;
+            return true;
+#else
+            (void)directory;
+            (void)bytes;
+            err = "Spill files are not supported on this platform.";
+            return false;
+#endif
+        }
+        /* A RefCountMemPool::BlockSource. Returns nullptr when the
+         * file is full or not mapped. */
+        static void *Allocate(size_t bytes)
+        {
+            auto &state = Current();
+            bytes = (bytes + Alignment - 1) / Alignment * Alignment;
+            if (!(bool)state.Base || state.Size - state.Used < bytes)
+            {
+                return nullptr;
+            }
+            auto block = state.Base + state.Used;
+            state.Used += bytes;
+            return block;
+        }
+        static size_t Size()
+        {
+            return Current().Size;
+        }
+        static size_t Used()
+        {
+            return Current().Used;
+        }
+    private:
+        struct State
+        {
+            char *Base;
+            size_t Size;
+            size_t Used;
+        };
+        static State &Current()
+        {
+            static State state = { nullptr, 0, 0 };
+            return state;
+        }
+    };
+}
+
+#endif // SPILL_HPP_
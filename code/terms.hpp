@@ -5,20 +5,80 @@
 
 #include"utils.hpp"
 #include<utility>
+#include<vector>
+
+namespace LambdaCalculus
+{
+    struct Term;
+}
+
+namespace Utilities
+{
+#ifdef LAMBDA_CALCULUS_TRACING_GC
+    /* Terms are collected by Reduction::TracingCollector. */
+    template <>
+    struct IsTraced<LambdaCalculus::Term>
+    {
+        static constexpr bool Value = true;
+    };
+#endif
+}
 
 namespace LambdaCalculus
 {
 
     typedef unsigned TermKind;
+    typedef unsigned NativeOperation;
 
     struct Term
     {
         typedef Utilities::RefCountPtr<Term> Pointer;
+        /* A pointer that does not own the term (see BorrowedPtr). */
+        typedef Utilities::BorrowedPtr<Term> BorrowedPointer;
+        /* Whether terms are traced instead of reference counted. */
+        static constexpr bool Traced = Utilities::IsTraced<Term>::Value;
 
         static constexpr TermKind InvalidTerm = 0;
         static constexpr TermKind BoundVariableTerm = 1;
         static constexpr TermKind AbstractionTerm = 2;
         static constexpr TermKind ApplicationTerm = 3;
+        static constexpr TermKind NativeTerm = 4;
+        /* An indirection is a reduced term overwritten in place by
+         * a reference to its result, so that all the references to
+         * the reduced term see the result. Visitors skip them. */
+        static constexpr TermKind IndirectionTerm = 5;
+        /* A substitution is a body with pending replacements of
+         * the variables of some binders (explicit substitution).
+         * It is pushed one level down when something looks into it,
+         * by overwriting it with an indirection, so visitors never
+         * see one. */
+        static constexpr TermKind SubstitutionTerm = 6;
+        /* A reference is a named edge to a closed term, through which
+         * a recursive definition refers to itself. The edge is weak,
+         * so the target must be kept alive elsewhere. */
+        static constexpr TermKind ReferenceTerm = 7;
+
+        /* Native terms stand for the closed Church-encoded terms
+         * of numerals and arithmetic combinators. */
+        static constexpr NativeOperation NativeNumeral = 0;
+        static constexpr NativeOperation NativeSuccessor = 1;
+        static constexpr NativeOperation NativePredecessor = 2;
+        static constexpr NativeOperation NativeIsZero = 3;
+        static constexpr NativeOperation NativeAddition = 4;
+        static constexpr NativeOperation NativeMultiplication = 5;
+
+        /* The binders of the free variables of a term are summarised
+         * as a set of at most MaxFreeBinders elements, or the set is
+         * marked as too large. The summary is computed by the
+         * constructors and may become imprecise when subterms are
+         * rewritten, but only by covering more than the actual free
+         * variables, which is safe. */
+        static constexpr unsigned MaxFreeBinders = 4;
+        static constexpr unsigned TooManyFreeBinders = MaxFreeBinders + 1;
+
+        struct Binding;
+        /* The bindings of a substitution, innermost first. */
+        typedef Utilities::RefCountPtr<Binding> BindingPtr;
 
         Term() = delete;
         Term(Term &&) = delete;
@@ -30,21 +90,43 @@ namespace LambdaCalculus
         void DefaultConstructor()
         {
             Kind = InvalidTerm;
+            FreeBinderCount = TooManyFreeBinders;
+            Normal = false;
             Tag.DefaultConstructor();
         }
 
-        void BoundVariableConstructor(Pointer boundBy)
+        void BoundVariableConstructor(BorrowedPointer boundBy)
         {
             Kind = BoundVariableTerm;
-            AsBoundVariable.BoundBy.MoveConstructor(std::move(boundBy));
-            AsBoundVariable.BoundBy.DecreaseReference();
+            AsBoundVariable.BoundBy.WeakConstructor(boundBy);
+            FreeBinderCount = 1;
+            FreeBinders[0] = AsBoundVariable.BoundBy.RawPtr();
+            Normal = false;
             Tag.DefaultConstructor();
         }
 
-        void AbstractionConstructor(Pointer result)
+        /* The variable must be bound by this term. It can be null
+         * if the body does not use the variable. */
+        void AbstractionConstructor(Pointer variable, Pointer result)
         {
             Kind = AbstractionTerm;
             AsAbstraction.Result.MoveConstructor(std::move(result));
+            AsAbstraction.Variable.MoveConstructor(std::move(variable));
+            AsAbstraction.Compiled.DefaultConstructor();
+            FreeBinderCount = 0;
+            MergeFreeBinders(AsAbstraction.Result.RawPtr());
+            if (FreeBinderCount <= MaxFreeBinders)
+            {
+                for (unsigned i = 0; i != FreeBinderCount; ++i)
+                {
+                    if (FreeBinders[i] == this)
+                    {
+                        FreeBinders[i] = FreeBinders[--FreeBinderCount];
+                        break;
+                    }
+                }
+            }
+            Normal = false;
             Tag.DefaultConstructor();
         }
 
@@ -53,36 +135,120 @@ namespace LambdaCalculus
             Kind = ApplicationTerm;
             AsApplication.Function.MoveConstructor(std::move(func));
             AsApplication.Replaced.MoveConstructor(std::move(rplc));
+            FreeBinderCount = 0;
+            MergeFreeBinders(AsApplication.Function.RawPtr());
+            MergeFreeBinders(AsApplication.Replaced.RawPtr());
+            Normal = false;
             Tag.DefaultConstructor();
         }
 
-        void Finalise()
+        void NativeConstructor(NativeOperation operation, size_t value = 0)
         {
-            switch (Kind)
+            Kind = NativeTerm;
+            AsNative.Operation = operation;
+            AsNative.Value = value;
+            FreeBinderCount = 0;
+            Normal = false;
+            Tag.DefaultConstructor();
+        }
+
+        void IndirectionConstructor(Pointer target)
+        {
+            Kind = IndirectionTerm;
+            AsIndirection.Target.MoveConstructor(std::move(target));
+            FreeBinderCount = 0;
+            MergeFreeBinders(AsIndirection.Target.RawPtr());
+            Normal = false;
+            Tag.DefaultConstructor();
+        }
+
+        /* The replacements of the environment must not refer to
+         * the binders of the environment. */
+        void SubstitutionConstructor(Pointer body, BindingPtr environment)
+        {
+            Kind = SubstitutionTerm;
+            AsSubstitution.Body.MoveConstructor(std::move(body));
+            AsSubstitution.Environment.MoveConstructor(std::move(environment));
+            auto const summarised = SkipIndirections(AsSubstitution.Body.RawPtr());
+            FreeBinderCount = 0;
+            if (summarised->FreeBinderCount > MaxFreeBinders)
             {
-                case BoundVariableTerm:
-                    /* We must NOT destroy AsBoundVariable.BoundBy
-                     * because the finalisation of this object
-                     * is caused by this BoundBy.
-                     * Note that we cannot first IncreaseReference
-                     * then Finalise the BoundBy, which will cause
-                     * the finalisation of BoundBy to run a second
-                     * time.
-                     */
-                    break;
-                case AbstractionTerm:
-                    AsAbstraction.Result.Finalise();
-                    break;
-                case ApplicationTerm:
-                    AsApplication.Function.Finalise();
-                    AsApplication.Replaced.Finalise();
-                    break;
+                FreeBinderCount = TooManyFreeBinders;
             }
+            else
+            {
+                for (unsigned i = 0; i != summarised->FreeBinderCount; ++i)
+                {
+                    auto const binder = summarised->FreeBinders[i];
+                    auto const binding = Find(AsSubstitution.Environment, binder);
+                    if (binding)
+                    {
+                        MergeFreeBinders(binding->Replaced.RawPtr());
+                    }
+                    else
+                    {
+                        AddFreeBinder(binder);
+                    }
+                }
+            }
+            Normal = false;
+            Tag.DefaultConstructor();
+        }
+
+        /* The target is set later by Tie. The name must outlive
+         * this term. */
+        void ReferenceConstructor(char const *name)
+        {
+            Kind = ReferenceTerm;
+            AsReference.Target.DefaultConstructor();
+            AsReference.Name = name;
+            FreeBinderCount = 0;
+            Normal = false;
+            Tag.DefaultConstructor();
+        }
+
+        /* Closes the cycle of a reference. The target must be closed. */
+        void Tie(BorrowedPointer target)
+        {
+            AsReference.Target.WeakConstructor(target);
+        }
+
+        /* Overwrites this term by an indirection to result.
+         * The tag is kept. */
+        void Overwrite(Pointer result)
+        {
+            Pointer keep = std::move(SkipIndirections(result));
+            FinaliseChildren();
+            Kind = IndirectionTerm;
+            Normal = false;
+            AsIndirection.Target.MoveConstructor(std::move(keep));
+            /* Reduction never introduces free variables, so the
+             * summary of the result is valid for this term. */
+            FreeBinderCount = 0;
+            MergeFreeBinders(AsIndirection.Target.RawPtr());
+        }
+
+        void Finalise()
+        {
+            FinaliseChildren();
             Tag.Finalise();
         }
 
+        /* Visitors tag every node they pass through, so an untagged
+         * node has no tagged descendants reachable through it.
+         * Indirections and substitutions are skipped by visitors,
+         * hence never tagged. */
         void RecursivelyClearTag()
         {
+            if (Kind == IndirectionTerm)
+            {
+                AsIndirection.Target->RecursivelyClearTag();
+                return;
+            }
+            if (!(bool)Tag)
+            {
+                return;
+            }
             Tag = nullptr;
             switch (Kind)
             {
@@ -96,7 +262,92 @@ namespace LambdaCalculus
             }
         }
 
+        /* Follows indirections and pushes substitutions down
+         * until the term is neither. */
+        static Pointer &Expose(Pointer &target)
+        {
+            while (SkipIndirections(target)->Kind == SubstitutionTerm)
+            {
+                PushSubstitutions(target.RawPtr());
+            }
+            return target;
+        }
+
+        static Pointer const &Expose(Pointer const &target)
+        {
+            while (SkipIndirections(target)->Kind == SubstitutionTerm)
+            {
+                PushSubstitutions(SkipIndirections(target).RawPtr());
+            }
+            return SkipIndirections(target);
+        }
+
+        static Term *Expose(Term *target)
+        {
+            while (SkipIndirections(target)->Kind == SubstitutionTerm)
+            {
+                PushSubstitutions(SkipIndirections(target));
+            }
+            return SkipIndirections(target);
+        }
+
+        static Term const *Expose(Term const *target)
+        {
+            while (SkipIndirections(target)->Kind == SubstitutionTerm)
+            {
+                PushSubstitutions(const_cast<Term *>(SkipIndirections(target)));
+            }
+            return SkipIndirections(target);
+        }
+
+        /* Follows indirections. The overload taking a non-const
+         * reference also shortcuts the reference itself. */
+        static Pointer &SkipIndirections(Pointer &target)
+        {
+            while (target->Kind == IndirectionTerm)
+            {
+                target = target->AsIndirection.Target;
+            }
+            return target;
+        }
+
+        static Pointer const &SkipIndirections(Pointer const &target)
+        {
+            auto result = &target;
+            while ((*result)->Kind == IndirectionTerm)
+            {
+                result = &(*result)->AsIndirection.Target;
+            }
+            return *result;
+        }
+
+        static Term *SkipIndirections(Term *target)
+        {
+            while (target->Kind == IndirectionTerm)
+            {
+                target = target->AsIndirection.Target.RawPtr();
+            }
+            return target;
+        }
+
+        static Term const *SkipIndirections(Term const *target)
+        {
+            while (target->Kind == IndirectionTerm)
+            {
+                target = target->AsIndirection.Target.RawPtr();
+            }
+            return target;
+        }
+
         TermKind Kind;
+        /* Set by BetaReduction when the term is known to be in beta
+         * normal form. Only rewriting that keeps the normal form
+         * (such as eta-conversion) may leave it set. */
+        bool Normal;
+        unsigned FreeBinderCount;
+        /* Not references. Only the first FreeBinderCount elements
+         * are meaningful, if FreeBinderCount <= MaxFreeBinders. */
+        Term *FreeBinders[MaxFreeBinders];
         /* Convention:
          * - If Kind == InvalidTerm, none of the union members are valid.
          * - If Kind == XTerm, where X is not "Invalid", AsX is valid.
@@ -111,16 +362,285 @@ namespace LambdaCalculus
             struct
             {
                 Pointer Result;
+                /* All the occurrences of the bound variable
+                 * are references to this term. */
+                Pointer Variable;
+                /* Kept by reducers for as long as the term lives,
+                 * e.g. Reduction::InstantiationTemplate. */
+                Utilities::VariantPtr Compiled;
             } AsAbstraction;
             struct
             {
                 Pointer Function;
                 Pointer Replaced;
             } AsApplication;
+            struct
+            {
+                Pointer Target;
+            } AsIndirection;
+            struct
+            {
+                Pointer Body;
+                BindingPtr Environment;
+            } AsSubstitution;
+            struct
+            {
+                /* Weak, like AsBoundVariable.BoundBy. */
+                Pointer Target;
+                char const *Name;
+            } AsReference;
+            struct
+            {
+                NativeOperation Operation;
+                /* Only meaningful for NativeNumeral. */
+                size_t Value;
+            } AsNative;
         };
         Utilities::VariantPtr Tag;
 
+        struct Binding
+        {
+            /* Held, so that it is not reused by another term while
+             * the variables it binds are being replaced. */
+            Pointer Binder;
+            Pointer Replaced;
+            BindingPtr Next;
+            Binding() = delete;
+            Binding(Binding &&) = delete;
+            Binding(Binding const &) = delete;
+            Binding &operator = (Binding &&) = delete;
+            Binding &operator = (Binding const &) = delete;
+            ~Binding() = delete;
+            void DefaultConstructor()
+            {
+                Binder.DefaultConstructor();
+                Replaced.DefaultConstructor();
+                Next.DefaultConstructor();
+            }
+            void Finalise()
+            {
+                Binder.Finalise();
+                Replaced.Finalise();
+                Next.Finalise();
+            }
+        };
+
+        static BindingPtr Bind(Pointer binder, Pointer replaced, BindingPtr next)
+        {
+            BindingPtr result;
+            auto binding = result.NewInstance();
+            binding->Binder = std::move(binder);
+            binding->Replaced = std::move(replaced);
+            binding->Next = std::move(next);
+            return result;
+        }
+
+        /* Lists the slots of the terms kept outside other terms, from
+         * which a tracing collector marks the live terms. */
+        typedef void RootSource(std::vector<Pointer const *> &roots);
+        static std::vector<RootSource *> &RootSources()
+        {
+            static std::vector<RootSource *> sources;
+            return sources;
+        }
+        /* Adding a source twice has no effect. */
+        static void AddRootSource(RootSource *source)
+        {
+            auto &sources = RootSources();
+            for (auto const added : sources)
+            {
+                if (added == source)
+                {
+                    return;
+                }
+            }
+            sources.push_back(source);
+        }
+
     private:
+        void FinaliseChildren()
+        {
+            switch (Kind)
+            {
+                case BoundVariableTerm:
+                    /* We must NOT destroy AsBoundVariable.BoundBy
+                     * because the finalisation of this object
+                     * is caused by this BoundBy.
+                     * Note that we cannot first IncreaseReference
+                     * then Finalise the BoundBy, which will cause
+                     * the finalisation of BoundBy to run a second
+                     * time.
+                     */
+                    break;
+                case AbstractionTerm:
+                    /* The result holds the other references to the
+                     * variable, so it goes first. */
+                    AsAbstraction.Result.Finalise();
+                    AsAbstraction.Variable.Finalise();
+                    AsAbstraction.Compiled.Finalise();
+                    break;
+                case ApplicationTerm:
+                    AsApplication.Function.Finalise();
+                    AsApplication.Replaced.Finalise();
+                    break;
+                case IndirectionTerm:
+                    AsIndirection.Target.Finalise();
+                    break;
+                case SubstitutionTerm:
+                    AsSubstitution.Body.Finalise();
+                    AsSubstitution.Environment.Finalise();
+                    break;
+                case ReferenceTerm:
+                    /* The target is not owned. */
+                    break;
+            }
+        }
+
+        static Binding const *Find(BindingPtr const &environment, Term const *binder)
+        {
+            auto binding = environment.RawPtr();
+            while (binding && binding->Binder.RawPtr() != binder)
+            {
+                binding = binding->Next.RawPtr();
+            }
+            return binding;
+        }
+
+        /* Whether target refers to none of the binders of environment. */
+        static bool Unaffected(Term const *target, BindingPtr const &environment)
+        {
+            if (target->FreeBinderCount > MaxFreeBinders)
+            {
+                return false;
+            }
+            for (unsigned i = 0; i != target->FreeBinderCount; ++i)
+            {
+                if (Find(environment, target->FreeBinders[i]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /* Pushes target, a substitution, one level down. Substitutions
+         * in the body are pushed first, without recursion. */
+        static void PushSubstitutions(Term *target)
+        {
+            std::vector<Term *> pending(1, target);
+            while (!pending.empty())
+            {
+                auto const top = pending.back();
+                auto const body = SkipIndirections(top->AsSubstitution.Body.RawPtr());
+                if (body->Kind == SubstitutionTerm)
+                {
+                    pending.push_back(body);
+                    continue;
+                }
+                pending.pop_back();
+                top->Overwrite(Substitute(
+                    SkipIndirections(top->AsSubstitution.Body),
+                    top->AsSubstitution.Environment));
+            }
+        }
+
+        /* Applies environment to the top node of body, which is
+         * not a substitution, and delays it for the children. */
+        static Pointer Substitute(Pointer const &body, BindingPtr const &environment)
+        {
+            if (Unaffected(body.RawPtr(), environment))
+            {
+                return body;
+            }
+            Pointer result;
+            switch (body->Kind)
+            {
+                case BoundVariableTerm:
+                {
+                    auto const binding = Find(environment, body->AsBoundVariable.BoundBy.RawPtr());
+                    return binding ? binding->Replaced : body;
+                }
+                case AbstractionTerm:
+                {
+                    /* The bound variable is renamed. */
+                    result.NewInstance();
+                    Pointer variable;
+                    BindingPtr inner = environment;
+                    if ((bool)body->AsAbstraction.Variable)
+                    {
+                        variable.NewInstance()->BoundVariableConstructor(result);
+                        inner = Bind(body, variable, std::move(inner));
+                    }
+                    result->AbstractionConstructor(std::move(variable),
+                        Delay(body->AsAbstraction.Result, inner));
+                    return result;
+                }
+                case ApplicationTerm:
+                    result.NewInstance()->ApplicationConstructor(
+                        Delay(body->AsApplication.Function, environment),
+                        Delay(body->AsApplication.Replaced, environment));
+                    return result;
+                default:
+                    return body;
+            }
+        }
+
+        static Pointer Delay(Pointer const &target, BindingPtr const &environment)
+        {
+            auto const &term = SkipIndirections(target);
+            if (Unaffected(term.RawPtr(), environment))
+            {
+                return term;
+            }
+            if (term->Kind == BoundVariableTerm)
+            {
+                auto const binding = Find(environment, term->AsBoundVariable.BoundBy.RawPtr());
+                return binding ? binding->Replaced : term;
+            }
+            Pointer result;
+            result.NewInstance()->SubstitutionConstructor(term, environment);
+            return result;
+        }
+
+        void AddFreeBinder(Term *binder)
+        {
+            if (FreeBinderCount > MaxFreeBinders)
+            {
+                return;
+            }
+            for (unsigned j = 0; j != FreeBinderCount; ++j)
+            {
+                if (FreeBinders[j] == binder)
+                {
+                    return;
+                }
+            }
+            if (FreeBinderCount == MaxFreeBinders)
+            {
+                FreeBinderCount = TooManyFreeBinders;
+                return;
+            }
+            FreeBinders[FreeBinderCount++] = binder;
+        }
+
+        void MergeFreeBinders(Term const *child)
+        {
+            child = SkipIndirections(child);
+            if (FreeBinderCount > MaxFreeBinders)
+            {
+                return;
+            }
+            if (child->FreeBinderCount > MaxFreeBinders)
+            {
+                FreeBinderCount = TooManyFreeBinders;
+                return;
+            }
+            for (unsigned i = 0; i != child->FreeBinderCount; ++i)
+            {
+                AddFreeBinder(child->FreeBinders[i]);
+            }
+        }
+
         /* The argument U is used to avoid full
          * template specialisation inside a struct,
          * which is a defect in C++11.
@@ -184,6 +704,10 @@ namespace LambdaCalculus
             TResult VisitTerm(typename VisitorPointerCheck<TPointer>::AdjustedPointer target, TArgs...args)
             {
                 auto that = static_cast<TVisitor *>(this);
+                if (target->Kind == IndirectionTerm || target->Kind == SubstitutionTerm)
+                {
+                    return VisitTerm(Expose(target), std::forward<TArgs>(args)...);
+                }
                 switch (target->Kind)
                 {
                     case InvalidTerm:
@@ -194,6 +718,10 @@ namespace LambdaCalculus
                         return that->VisitAbstractionTerm(target, std::forward<TArgs>(args)...);
                     case ApplicationTerm:
                         return that->VisitApplicationTerm(target, std::forward<TArgs>(args)...);
+                    case NativeTerm:
+                        return that->VisitNativeTerm(target, std::forward<TArgs>(args)...);
+                    case ReferenceTerm:
+                        return that->VisitReferenceTerm(target, std::forward<TArgs>(args)...);
                     default:
                         return that->VisitInternalErrorTerm(target, std::forward<TArgs>(args)...);
                 }
@@ -0,0 +1,210 @@
+#include"../terms.hpp"
+#include"../parser.hpp"
+#include<chrono>
+#include<cstdio>
+#include<cstring>
+#include<string>
+#include"toy.hpp"
+
+using namespace DeBruijnIndex::Lexer;
+
+typedef std::chrono::steady_clock Clock;
+
+/* The lexer before the character table, which scans the character
+ * sets for every character, kept for comparison. */
+struct BaselineTokenSource
+{
+    explicit BaselineTokenSource(char const *in)
+        : input(in)
+    {
+        DiscardCurrent();
+    }
+    void DiscardCurrent()
+    {
+        for (; IsWhitespace(*input); ++input)
+            ;
+        if (*input == '\0')
+        {
+            current = { Token::EndOfInputToken, input, 0 };
+            return;
+        }
+        if (*input == '(' || *input == ')' || *input == '.')
+        {
+            input += 1;
+            current = { *(input - 1) == '(' ? Token::LParenthesisToken
+                : *(input - 1) == ')' ? Token::RParenthesisToken
+                : Token::LambdaToken, input - 1, 1 };
+            return;
+        }
+        if (StringStartsWith(input, "lambda")
+            && !IsIdentifierFollowingChar(input[6]))
+        {
+            input += 6;
+            current = { Token::LambdaToken, input - 6, 6 };
+            return;
+        }
+        if (StringStartsWith(input, "let")
+            && !IsIdentifierFollowingChar(input[3]))
+        {
+            input += 3;
+            current = { Token::LetToken, input - 3, 3 };
+            return;
+        }
+        if (StringStartsWith(input, "in")
+            && !IsIdentifierFollowingChar(input[2]))
+        {
+            input += 2;
+            current = { Token::InToken, input - 2, 2 };
+            return;
+        }
+        if (IsIdentifierBeginChar(*input))
+        {
+            auto begin = input;
+            for (; IsIdentifierFollowingChar(*input); ++input)
+                ;
+            current = { Token::NamedObjectToken, begin, (size_t)(input - begin) };
+            return;
+        }
+        if (IsDigit(*input) || *input == '#')
+        {
+            auto begin = input;
+            bool const numeral = *input == '#';
+            input += numeral ? 1 : 0;
+            size_t value = 0;
+            for (; IsDigit(*input); ++input)
+            {
+                value = value * 10 + (*input - '0');
+            }
+            current = { numeral ? Token::NumeralToken : Token::BoundVariableToken,
+                begin, (size_t)(input - begin), value };
+            return;
+        }
+        current = { Token::InvalidToken, input, 0, 0, "Unrecognised token." };
+    }
+    Token const PeekCurrent() const
+    {
+        return current;
+    }
+private:
+    char const *input;
+    Token current;
+    static bool StringContainsChar(char const *str, char ch)
+    {
+        for (; *str && *str != ch; ++str)
+            ;
+        return *str;
+    }
+    /* The whole pattern must match, including its last character,
+     * so that ix is not lexed as in, nor lex as let. */
+    static bool StringStartsWith(char const *str, char const *pattern)
+    {
+        for (; *pattern && *pattern == *str; ++pattern, ++str)
+            ;
+        return !*pattern;
+    }
+    static bool IsWhitespace(char ch)
+    {
+        return StringContainsChar(" \t\v\b\r\n", ch);
+    }
+    static bool IsDigit(char ch)
+    {
+        return ch >= '0' && ch <= '9';
+    }
+    static bool IsIdentifierBeginChar(char ch)
+    {
+        return (ch >= 'A' && ch <= 'Z')
+            || (ch >= 'a' && ch <= 'z')
+            || StringContainsChar("~!$%^&*-+=|\\/<>?_", ch);
+    }
+    static bool IsIdentifierFollowingChar(char ch)
+    {
+        return IsDigit(ch) || IsIdentifierBeginChar(ch);
+    }
+};
+
+/* Lexes the whole input, and sums the kinds, lengths and values
+ * of the tokens, so that both lexers can be compared. */
+template <typename TSource>
+size_t Lex(char const *input, size_t &tokens)
+{
+    TSource source(input);
+    size_t sum = 0;
+    tokens = 0;
+    for (auto token = source.PeekCurrent();
+        token.Kind != Token::EndOfInputToken && token.Kind != Token::InvalidToken;
+        source.DiscardCurrent(), token = source.PeekCurrent())
+    {
+        sum = sum * 31 + token.Kind * 7 + token.Length * 3 + token.Value;
+        ++tokens;
+    }
+    return sum;
+}
+
+/* The best of a few rounds, in MB/s. */
+template <typename TSource>
+double Throughput(std::string const &input, size_t &sum, size_t &tokens)
+{
+    double best = 0;
+    for (int round = 0; round != 5; ++round)
+    {
+        auto const started = Clock::now();
+        sum = Lex<TSource>(input.c_str(), tokens);
+        double const seconds = std::chrono::duration<double>(Clock::now() - started).count();
+        double const rate = (double)input.size() / seconds / (1 << 20);
+        best = rate > best ? rate : best;
+    }
+    return best;
+}
+
+/* A numeral as printed by the playground, one token per two bytes. */
+std::string GeneratedNumeral(size_t value)
+{
+    std::string input = "lambda lambda";
+    for (size_t i = 0; i != value; ++i)
+    {
+        input += " 2 (";
+    }
+    input += " 1";
+    input.append(value, ')');
+    return input;
+}
+
+/* Long names and indentation, as in written programs. */
+std::string GeneratedProgram(size_t lines)
+{
+    static char const *const names[] = {
+        "compose_with_accumulator", "successor", "ListFoldRight",
+        "predecessor_of_numeral", "<=>", "is-zero?", "multiply_all",
+        "ix", "lex"
+    };
+    std::string input;
+    for (size_t i = 0; i != lines; ++i)
+    {
+        input.append(4 + i % 4 * 4, ' ');
+        input += "(lambda ";
+        input += names[i % 9];
+        input += ' ';
+        input += names[(i + 3) % 9];
+        input += " (. 1 #";
+        input += std::to_string(i % 100);
+        input += "))\n";
+    }
+    return input;
+}
+
+int main()
+{
+    std::string const inputs[] = { GeneratedNumeral(4 << 20), GeneratedProgram(1 << 17) };
+    char const *const names[] = { "numeral", "program" };
+    for (size_t i = 0; i != 2; ++i)
+    {
+        size_t baselineSum, baselineTokens, sum, tokens;
+        double const baseline = Throughput<BaselineTokenSource>(inputs[i], baselineSum, baselineTokens);
+        double const current = Throughput<TokenSource>(inputs[i], sum, tokens);
+        printf("%s: %.1f MB, %zu tokens; baseline %.1f MB/s, table %.1f MB/s (%.2fx); same tokens: %s\n",
+            names[i], (double)inputs[i].size() / (1 << 20), tokens,
+            baseline, current, current / baseline,
+            sum == baselineSum && tokens == baselineTokens ? "yes" : "no");
+    }
+    return 0;
+}
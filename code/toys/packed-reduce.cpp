@@ -0,0 +1,72 @@
+#include"../terms.hpp"
+#include"../parser.hpp"
+#include"../reducer.hpp"
+#include"../packed.hpp"
+#include<chrono>
+#include<cstdio>
+#include"toy.hpp"
+
+using namespace DeBruijnIndex::Parser;
+using namespace LambdaCalculus::Reduction;
+namespace Packed = LambdaCalculus::Packed;
+
+char buffer[8192];
+
+static constexpr size_t MaxSteps = 1 << 20;
+
+typedef std::chrono::steady_clock Clock;
+
+double Elapsed(Clock::time_point started)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+}
+
+/* Reduces each term to its beta normal form in normal order with
+ * BetaReduction and with the packed representation, and compares
+ * the results and the times. */
+int main()
+{
+    std::vector<Packed::Cell> cells, scratch, expected;
+    while (scanf("%[^\n]", buffer) == 1)
+    {
+        EatLine();
+        char const *err, *errpos;
+        TermPtr result;
+        if (!Parse(buffer, result, err, errpos, EmptyConstantTable))
+        {
+            PutParserError(buffer, err, errpos);
+            continue;
+        }
+        HintAndPrintTerm("     Formatted: ", result);
+        if (!Packed::Encoder::Perform(result, cells))
+        {
+            fputs("Error: cannot be packed.\n", stderr);
+            continue;
+        }
+        auto started = Clock::now();
+        size_t steps = 0;
+        while (steps != MaxSteps && BetaReduction::Perform(result))
+        {
+            ++steps;
+        }
+        double const pointerMilliseconds = Elapsed(started);
+        started = Clock::now();
+        size_t packedSteps = 0;
+        auto outcome = Packed::Outcome::Reduced;
+        while (packedSteps != MaxSteps
+            && (outcome = Packed::NormalOrder::Perform(cells, scratch)) == Packed::Outcome::Reduced)
+        {
+            ++packedSteps;
+        }
+        double const packedMilliseconds = Elapsed(started);
+        HintAndPrintTerm("   Normal form: ", result);
+        bool const same = Packed::Encoder::Perform(result, expected) && expected == cells;
+        printf("       Pointer: %zu steps, %.3f ms\n", steps, pointerMilliseconds);
+        printf("        Packed: %zu steps, %.3f ms, %zu cells%s\n",
+            packedSteps, packedMilliseconds, cells.size(),
+            outcome == Packed::Outcome::TooDeep ? ", too deep" : "");
+        HintAndPrintTerm("      Unpacked: ", Packed::Decoder::Perform(cells));
+        printf("          Same: %s\n", same ? "yes" : "no");
+    }
+    return 0;
+}
@@ -41,6 +41,22 @@ private:
     {
         fprintf(fp, "%zu", level - target->AsBoundVariable.BoundBy->Tag.RawPtrUnsafe<VariableNameTag>()->Value);
     }
+    /* Numerals are printed as literals, as their Church forms
+     * might not fit in memory. */
+    void VisitNativeTerm(TermPtr const &target, FILE *fp, size_t level, bool lastAbs)
+    {
+        if (target->AsNative.Operation == Term::NativeNumeral)
+        {
+            fprintf(fp, "#%zu", target->AsNative.Value);
+            return;
+        }
+        VisitTerm(DeBruijnIndex::Parser::ChurchEncoding::Operation(target->AsNative.Operation),
+            fp, level, lastAbs);
+    }
+    void VisitReferenceTerm(TermPtr const &target, FILE *fp, size_t, bool)
+    {
+        fputs(target->AsReference.Name, fp);
+    }
     void VisitAbstractionTerm(TermPtr const &target, FILE *fp, size_t level, bool lastAbs)
     {
         target->Tag.NewInstance<VariableNameTag>()->Value = level++;
@@ -61,7 +77,7 @@ private:
     {
         auto const &func = target->AsApplication.Function;
         auto const &rplc = target->AsApplication.Replaced;
-        bool const paren = (rplc->Kind == Term::ApplicationTerm);
+        bool const paren = (Term::Expose(rplc.RawPtr())->Kind == Term::ApplicationTerm);
         VisitTerm(func, fp, level, false);
         putchar(' ');
         if (paren)
@@ -3,6 +3,7 @@
 #ifndef UTILS_HPP_
 #define UTILS_HPP_ 1
 
+#include<cstdio>
 #include<cstdlib>
 #include<utility>
 #include<cstddef>
@@ -18,9 +19,22 @@ namespace Utilities
      *   resources for reuse (does not need to reset the memory).
      */
 
+    /* Whether the objects of type TSmartValueType are managed by a
+     * tracing collector instead of by their reference counts, which
+     * are then not kept: releasing a RefCountPtr frees nothing, and
+     * the pool frees the entries left unmarked by the collector
+     * (RefCountMemPool::Sweep). Specialised by the users of such
+     * pools. */
+    template <typename TSmartValueType>
+    struct IsTraced
+    {
+        static constexpr bool Value = false;
+    };
+
     template <typename TSmartValueType>
     struct RefCountMemPool
     {
+        static constexpr bool Traced = IsTraced<TSmartValueType>::Value;
         struct Entry
         {
             union
@@ -36,10 +50,46 @@ namespace Utilities
             Entry &operator = (Entry const &) = delete;
             ~Entry() = delete;
         };
+        /* A scope in which the entries are allocated from the region
+         * of the pool instead of its free entries. The region is a
+         * list of blocks taken in order (bump allocation), and the
+         * entries freed in the scope are reused by the scope only.
+         * When the outermost scope ends with no entry of the region
+         * alive, the region is emptied at once, and its blocks are
+         * kept for the next scope. Otherwise, the blocks with entries
+         * still alive are promoted to the pool, and their other
+         * entries become free entries of the pool. Inner scopes
+         * belong to the outermost one. */
+        struct Region
+        {
+            Region(RefCountMemPool &pool = Default)
+                : pool(pool)
+            {
+                ++pool.regionDepth;
+            }
+            Region(Region const &) = delete;
+            Region(Region &&) = delete;
+            Region &operator = (Region const &) = delete;
+            Region &operator = (Region &&) = delete;
+            ~Region()
+            {
+                if (!--pool.regionDepth)
+                {
+                    pool.EndRegion();
+                }
+            }
+        private:
+            RefCountMemPool &pool;
+        };
+        /* Returns storage for a block of the given size, or nullptr.
+         * Blocks from a source are never given back to it. */
+        typedef void *BlockSource(size_t bytes);
         RefCountMemPool(size_t suggested = 16)
-            : entries(nullptr), blocks(nullptr),
+            : blockSource(nullptr), entries(nullptr), blocks(nullptr),
             nextAlloc(suggested < 16 ? 16 : suggested > 1024 ? 1024 : suggested),
-            currentCount(0)
+            currentCount(0), liveCount(0), allocationCount(0),
+            regionBlocks(nullptr), regionCurrent(nullptr), regionUsed(0),
+            regionEntries(nullptr), regionLiveCount(0), regionDepth(0)
         {
         }
         RefCountMemPool(RefCountMemPool const &) = delete;
@@ -51,11 +101,27 @@ namespace Utilities
             for (auto i = blocks; i; )
             {
                 auto ni = i->NextBlock;
-                std::free(i);
+                FreeBlock(i, i->FromSource);
+                i = ni;
+            }
+            for (auto i = regionBlocks; i; )
+            {
+                auto ni = i->NextBlock;
+                FreeBlock(i, i->FromSource);
                 i = ni;
             }
         }
+        /* New blocks are taken from source first, and from malloc
+         * when it has no more, or when source is nullptr. */
+        void SetBlockSource(BlockSource *source)
+        {
+            blockSource = source;
+        }
         size_t Capacity() const { return currentCount; }
+        /* Number of entries currently handed out. */
+        size_t LiveCount() const { return liveCount; }
+        /* Number of calls to Allocate that succeeded. */
+        size_t AllocationCount() const { return allocationCount; }
         bool EnsureCapacity(size_t expect)
         {
             if (expect <= currentCount)
@@ -67,15 +133,18 @@ namespace Utilities
             toAlloc = (toAlloc < nextAlloc ? nextAlloc : toAlloc);
             nextAlloc = (toAlloc < 2048 ? toAlloc * 2 : 4096);
             /* Allocate a new block and prepend it to the block list. */
-            auto newBlock = (Block *)std::malloc(sizeof(Block) + sizeof(Entry) * toAlloc);
+            bool fromSource;
+            auto newBlock = (Block *)AllocateBlock(sizeof(Block) + sizeof(Entry) * toAlloc, fromSource);
             if (!(bool)newBlock)
             {
                 return false;
             }
+            newBlock->FromSource = fromSource;
+            newBlock->Count = toAlloc;
             newBlock->NextBlock = blocks;
             blocks = newBlock;
             /* Link the new entries. */
-            auto newEntries = (Entry *)(void *)(newBlock + 1);
+            auto newEntries = newBlock->Entries();
             for (size_t i = 0; i + 1 != toAlloc; ++i)
             {
                 newEntries[i].NextEntry = newEntries + (i + 1);
@@ -85,35 +154,270 @@ namespace Utilities
             currentCount += toAlloc;
             return true;
         }
+        /* Never returns nullptr: if neither the block source nor
+         * malloc has a block left, the program ends (OutOfMemory),
+         * since the callers use the entry at once. */
         Entry *Allocate()
         {
-            if (!EnsureCapacity(1))
+            Entry *entry;
+            if (regionDepth != 0)
             {
-                return nullptr;
+                entry = AllocateInRegion();
+                if (!(bool)entry)
+                {
+                    OutOfMemory();
+                }
+                ++regionLiveCount;
             }
-            auto entry = entries;
-            entries = entry->NextEntry;
-            entry->ReferenceCount = 0;
+            else
+            {
+                if (!EnsureCapacity(1))
+                {
+                    OutOfMemory();
+                }
+                entry = entries;
+                entries = entry->NextEntry;
+                --currentCount;
+            }
+            entry->ReferenceCount = Traced ? Unmarked : 0;
             entry->Data.DefaultConstructor();
-            --currentCount;
+            ++liveCount;
+            ++allocationCount;
             return entry;
         }
         void Deallocate(Entry *entry)
         {
             entry->Data.Finalise();
+            --liveCount;
+            if (regionDepth != 0 && InRegion(entry))
+            {
+                entry->NextEntry = regionEntries;
+                regionEntries = entry;
+                --regionLiveCount;
+                return;
+            }
             entry->NextEntry = entries;
             entries = entry;
             ++currentCount;
         }
+        /* Marks a live entry of a traced pool. Returns false if it
+         * was already marked. */
+        static bool Mark(Entry *entry)
+        {
+            if (entry->ReferenceCount == Marked)
+            {
+                return false;
+            }
+            entry->ReferenceCount = Marked;
+            return true;
+        }
+        /* Frees the live entries of a traced pool that are not
+         * marked, and unmarks the others. The pool must not be in a
+         * region. Returns the number of entries freed. */
+        size_t Sweep()
+        {
+            if (!Traced || regionDepth != 0)
+            {
+                return 0;
+            }
+            size_t freed = 0;
+            for (auto block = blocks; (bool)block; block = block->NextBlock)
+            {
+                auto const first = block->Entries();
+                for (size_t i = 0; i != block->Count; ++i)
+                {
+                    /* Free entries hold a pointer instead. */
+                    if (first[i].ReferenceCount == Marked)
+                    {
+                        first[i].ReferenceCount = Unmarked;
+                    }
+                    else if (first[i].ReferenceCount == Unmarked)
+                    {
+                        Deallocate(first + i);
+                        ++freed;
+                    }
+                }
+            }
+            return freed;
+        }
         static RefCountMemPool<TSmartValueType> Default;
     private:
+        /* The states of the live entries of a traced pool, kept in
+         * place of the reference count. No free entry can hold them,
+         * as its NextEntry is null or a pointer to an entry. */
+        static constexpr size_t Unmarked = 1;
+        static constexpr size_t Marked = 2;
+        BlockSource *blockSource;
         Entry *entries;
         struct Block
         {
             Block *NextBlock;
+            bool FromSource;
+            size_t Count;
+            Entry *Entries()
+            {
+                return (Entry *)(void *)(this + 1);
+            }
         } *blocks;
         size_t nextAlloc;
         size_t currentCount;
+        size_t liveCount;
+        size_t allocationCount;
+        /* The blocks of the region, in the order they are taken.
+         * The layout is that of Block, so that a region block can be
+         * promoted to the pool. */
+        struct RegionBlock
+        {
+            RegionBlock *NextBlock;
+            bool FromSource;
+            size_t Count;
+            Entry *Entries()
+            {
+                return (Entry *)(void *)(this + 1);
+            }
+        } *regionBlocks, *regionCurrent;
+        /* Entries of regionCurrent already taken. */
+        size_t regionUsed;
+        Entry *regionEntries;
+        size_t regionLiveCount;
+        unsigned regionDepth;
+        [[noreturn]] static void OutOfMemory()
+        {
+            fprintf(stderr, "Fatal: out of memory for %zu-byte entries (the block source and malloc are exhausted).\n",
+                sizeof(Entry));
+            std::abort();
+        }
+        void *AllocateBlock(size_t bytes, bool &fromSource)
+        {
+            void *block = (bool)blockSource ? blockSource(bytes) : nullptr;
+            fromSource = (bool)block;
+            return (bool)block ? block : std::malloc(bytes);
+        }
+        static void FreeBlock(void *block, bool fromSource)
+        {
+            if (!fromSource)
+            {
+                std::free(block);
+            }
+        }
+        Entry *AllocateInRegion()
+        {
+            if ((bool)regionEntries)
+            {
+                auto entry = regionEntries;
+                regionEntries = entry->NextEntry;
+                return entry;
+            }
+            if (!(bool)regionCurrent || regionUsed == regionCurrent->Count)
+            {
+                auto next = (bool)regionCurrent ? regionCurrent->NextBlock : regionBlocks;
+                if (!(bool)next)
+                {
+                    /* Each new block is as large as the region so far. */
+                    size_t count = 0;
+                    for (auto i = regionBlocks; i; i = i->NextBlock)
+                    {
+                        count += i->Count;
+                    }
+                    count = count < 1024 ? 1024 : count;
+                    bool fromSource;
+                    next = (RegionBlock *)AllocateBlock(sizeof(RegionBlock) + sizeof(Entry) * count, fromSource);
+                    if (!(bool)next)
+                    {
+                        return nullptr;
+                    }
+                    next->FromSource = fromSource;
+                    next->NextBlock = nullptr;
+                    next->Count = count;
+                    if ((bool)regionCurrent)
+                    {
+                        regionCurrent->NextBlock = next;
+                    }
+                    else
+                    {
+                        regionBlocks = next;
+                    }
+                }
+                regionCurrent = next;
+                regionUsed = 0;
+            }
+            return regionCurrent->Entries() + regionUsed++;
+        }
+        bool InRegion(Entry const *entry)
+        {
+            /* The current block is the largest one. */
+            if ((bool)regionCurrent && entry >= regionCurrent->Entries()
+                && entry < regionCurrent->Entries() + regionCurrent->Count)
+            {
+                return true;
+            }
+            for (auto i = regionBlocks; (bool)i; i = i->NextBlock)
+            {
+                if (entry >= i->Entries() && entry < i->Entries() + i->Count)
+                {
+                    return true;
+                }
+                if (i == regionCurrent)
+                {
+                    break;
+                }
+            }
+            return false;
+        }
+        void EndRegion()
+        {
+            if (regionLiveCount != 0)
+            {
+                PromoteRegion();
+            }
+            regionCurrent = nullptr;
+            regionUsed = 0;
+            regionEntries = nullptr;
+        }
+        /* Moves the blocks with live entries to the pool. An entry is
+         * dead if it is in regionEntries, or not taken yet. */
+        void PromoteRegion()
+        {
+            for (auto entry = regionEntries; (bool)entry; )
+            {
+                auto next = entry->NextEntry;
+                entry->NextEntry = entry;
+                entry = next;
+            }
+            RegionBlock **link = &regionBlocks;
+            bool more = (bool)regionCurrent;
+            while (more)
+            {
+                auto block = *link;
+                more = block != regionCurrent;
+                auto const used = more ? block->Count : regionUsed;
+                auto const first = block->Entries();
+                bool alive = false;
+                for (size_t i = 0; i != used && !alive; ++i)
+                {
+                    alive = first[i].NextEntry != first + i;
+                }
+                if (!alive)
+                {
+                    link = &block->NextBlock;
+                    continue;
+                }
+                *link = block->NextBlock;
+                auto promoted = (Block *)(void *)block;
+                promoted->NextBlock = blocks;
+                blocks = promoted;
+                for (size_t i = block->Count; i-- != 0; )
+                {
+                    if (i >= used || first[i].NextEntry == first + i)
+                    {
+                        first[i].NextEntry = entries;
+                        entries = first + i;
+                        ++currentCount;
+                    }
+                }
+            }
+            regionLiveCount = 0;
+        }
     };
 
     template <typename TSmartValueType>
@@ -122,11 +426,31 @@ namespace Utilities
 
     struct VariantPtr;
 
+#ifdef UTILITIES_COUNT_REFERENCES
+    /* The number of times a reference count has been changed,
+     * for measuring how many are spent per reduction step. */
+    struct ReferenceCounter
+    {
+        static size_t &Changes()
+        {
+            static size_t changes = 0;
+            return changes;
+        }
+    };
+#define UTILITIES_COUNT_REFERENCE_() (++Utilities::ReferenceCounter::Changes())
+#else
+#define UTILITIES_COUNT_REFERENCE_() ((void)0)
+#endif
+
+    template <typename TSmartValueType>
+    struct BorrowedPtr;
+
     /* RefCountPtr itself is a smart value type. */
     template <typename TSmartValueType>
     struct RefCountPtr
     {
         friend struct VariantPtr;
+        friend struct BorrowedPtr<TSmartValueType>;
     private:
         typedef RefCountMemPool<TSmartValueType> MemPool;
         typename MemPool::Entry *entry;
@@ -158,13 +482,27 @@ namespace Utilities
             DefaultConstructor();
             return *this;
         }
-        RefCountPtr &operator = (RefCountPtr other)
+        /* The new object is referenced before the old one is
+         * released, since releasing it might release other. */
+        RefCountPtr &operator = (RefCountPtr const &other)
         {
             if (entry != other.entry)
             {
-                auto tmp = entry;
-                entry = other.entry;
-                other.entry = tmp;
+                auto const kept = other.entry;
+                other.IncreaseReference();
+                Finalise();
+                entry = kept;
+            }
+            return *this;
+        }
+        RefCountPtr &operator = (RefCountPtr &&other)
+        {
+            if (this != &other)
+            {
+                auto const kept = other.entry;
+                other.entry = nullptr;
+                Finalise();
+                entry = kept;
             }
             return *this;
         }
@@ -182,11 +520,21 @@ namespace Utilities
             entry = other.entry;
             other.entry = nullptr;
         }
+        /* Refers to the object without owning it (a weak reference),
+         * so the pointer must never be Finalise()d. */
+        void WeakConstructor(BorrowedPtr<TSmartValueType> const &other)
+        {
+            entry = other.entry;
+        }
         void Finalise()
         {
-            if ((bool)entry && --entry->ReferenceCount == 0)
+            if ((bool)entry && !MemPool::Traced)
             {
-                MemPool::Default.Deallocate(entry);
+                UTILITIES_COUNT_REFERENCE_();
+                if (--entry->ReferenceCount == 0)
+                {
+                    MemPool::Default.Deallocate(entry);
+                }
             }
         }
         ~RefCountPtr()
@@ -197,12 +545,16 @@ namespace Utilities
         {
             Finalise();
             entry = MemPool::Default.Allocate();
-            if ((bool)entry)
+            if (!(bool)entry)
+            {
+                return nullptr;
+            }
+            if (!MemPool::Traced)
             {
+                UTILITIES_COUNT_REFERENCE_();
                 ++entry->ReferenceCount;
-                return &entry->Data;
             }
-            return nullptr;
+            return &entry->Data;
         }
         TSmartValueType *operator -> () const
         {
@@ -212,6 +564,18 @@ namespace Utilities
         {
             return (bool)entry ? &entry->Data : nullptr;
         }
+        /* The number of strong references to the object,
+         * or 0 for a null pointer or a traced object. */
+        size_t ReferenceCount() const
+        {
+            return (bool)entry && !MemPool::Traced ? entry->ReferenceCount : 0;
+        }
+        /* Marks the object for a tracing collector. Returns false
+         * if it is null or was already marked. */
+        bool Mark() const
+        {
+            return (bool)entry && MemPool::Mark(entry);
+        }
         explicit operator bool () const
         {
             return (bool)entry;
@@ -258,15 +622,17 @@ namespace Utilities
         }
         void IncreaseReference() const
         {
-            if ((bool)entry)
+            if ((bool)entry && !MemPool::Traced)
             {
+                UTILITIES_COUNT_REFERENCE_();
                 ++entry->ReferenceCount;
             }
         }
         void DecreaseReference() const
         {
-            if ((bool)entry)
+            if ((bool)entry && !MemPool::Traced)
             {
+                UTILITIES_COUNT_REFERENCE_();
                 --entry->ReferenceCount;
             }
         }
@@ -276,6 +642,57 @@ namespace Utilities
         }
     };
 
+    /* A pointer borrowed from a RefCountPtr. It does not own the
+     * object, so it is copied and dropped without touching the
+     * reference count, and the object must be kept alive by its
+     * owners for as long as the borrowed pointer is used. */
+    template <typename TSmartValueType>
+    struct BorrowedPtr
+    {
+        friend struct RefCountPtr<TSmartValueType>;
+    private:
+        typedef RefCountMemPool<TSmartValueType> MemPool;
+        typename MemPool::Entry *entry;
+    public:
+        BorrowedPtr(std::nullptr_t = nullptr)
+        {
+            DefaultConstructor();
+        }
+        BorrowedPtr(RefCountPtr<TSmartValueType> const &owner)
+        {
+            entry = owner.entry;
+        }
+        void DefaultConstructor()
+        {
+            entry = nullptr;
+        }
+        /* A new strong reference to the object. */
+        RefCountPtr<TSmartValueType> Own() const
+        {
+            return RefCountPtr<TSmartValueType>(entry);
+        }
+        TSmartValueType *operator -> () const
+        {
+            return RawPtr();
+        }
+        TSmartValueType *RawPtr() const
+        {
+            return (bool)entry ? &entry->Data : nullptr;
+        }
+        explicit operator bool () const
+        {
+            return (bool)entry;
+        }
+        friend bool operator == (BorrowedPtr const &a, BorrowedPtr const &b)
+        {
+            return a.entry == b.entry;
+        }
+        friend bool operator != (BorrowedPtr const &a, BorrowedPtr const &b)
+        {
+            return a.entry != b.entry;
+        }
+    };
+
     struct VariantPtr
     {
     private:
@@ -287,18 +704,21 @@ namespace Utilities
         static void IncreaseReferenceStatic(void *entry)
         {
             auto typed = (typename RefCountMemPool<T>::Entry *)entry;
+            UTILITIES_COUNT_REFERENCE_();
             ++typed->ReferenceCount;
         }
         template <typename T>
         static void DecreaseReferenceStatic(void *entry)
         {
             auto typed = (typename RefCountMemPool<T>::Entry *)entry;
+            UTILITIES_COUNT_REFERENCE_();
             --typed->ReferenceCount;
         }
         template <typename T>
         static void ReleaseReferenceStatic(void *entry)
         {
             auto typed = (typename RefCountMemPool<T>::Entry *)entry;
+            UTILITIES_COUNT_REFERENCE_();
             if (!--typed->ReferenceCount)
             {
                 RefCountMemPool<T>::Default.Deallocate(typed);